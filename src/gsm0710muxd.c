@@ -32,20 +32,37 @@
 #include <fcntl.h>
 #include <features.h>
 #include <paths.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <syslog.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define GSM0710_ADV_ESCAPE_BLOCK 16
+#elif defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GSM0710_ADV_ESCAPE_BLOCK 16
+#endif
 #include <glib.h> // http://library.gnome.org/devel/glib/unstable/glib-core.html
 #include <dbus/dbus.h> // http://dbus.freedesktop.org/doc/dbus/libdbus-tutorial.html
 #include <dbus/dbus-glib.h> // http://dbus.freedesktop.org/doc/dbus-glib/
@@ -80,6 +97,14 @@ DBusConnection* dbus_g_connection_get_connection(DBusGConnection *gconnection);
 #define GSM0710_TYPE_DISC 0x43//67 Disconnect
 #define GSM0710_TYPE_UIH 0xEF//239 Unnumbered information with header check
 #define GSM0710_TYPE_UI 0x03//3 Unnumbered Acknowledgement
+// numbered frames of the error recovery mode, N(S) goes to bits 2-4 and
+// N(R) to bits 6-8 of the control field
+#define GSM0710_TYPE_I 0x00//0 Information
+#define GSM0710_TYPE_RR 0x01//1 Receive Ready
+#define GSM0710_TYPE_RNR 0x05//5 Receive Not Ready
+#define GSM0710_TYPE_REJ 0x09//9 Reject
+#define GSM0710_NS(n) ((n) << 1)
+#define GSM0710_NR(n) ((n) << 5)
 // control channel commands
 #define GSM0710_CONTROL_PN (0x80|GSM0710_EA)//?? DLC parameter negotiation
 #define GSM0710_CONTROL_CLD (0xC0|GSM0710_EA)//193 Multiplexer close down
@@ -105,19 +130,88 @@ DBusConnection* dbus_g_connection_get_connection(DBusGConnection *gconnection);
 //
 #define GSM0710_COMMAND_IS(type, command) ((type & ~GSM0710_CR) == command)
 #define GSM0710_FRAME_IS(type, frame) ((frame->control & ~GSM0710_PF) == type)
+#define GSM0710_FRAME_IS_I(frame) ((frame->control & 1) == 0)
+#define GSM0710_FRAME_IS_S(frame) ((frame->control & 3) == 1)
+// the FCS of UIH frames covers the header only, of the others the data too
+#define GSM0710_FCS_DATA(control) (((control) & ~GSM0710_PF) != GSM0710_TYPE_UIH)
+// +CMUX subset of the error recovery mode
+#define GSM0710_SUBSET_I 2
+// largest window size (k), the frames are numbered modulo 8
+#define GSM0710_MAX_K 7
 #ifndef min
 #define min(a,b) ((a < b) ? a :b)
 #endif
+#ifndef max
+#define max(a,b) ((a > b) ? a :b)
+#endif
 #define GSM0710_WRITE_RETRIES 5
 #define GSM0710_MAX_CHANNELS 32
 // Defines how often the modem is polled when automatic restarting is
 // enabled The value is in seconds
 #define GSM0710_POLLING_INTERVAL 5
+// Default size of the receive ring, rounded up to a power of two and
+// at least a page
 #define GSM0710_BUFFER_SIZE 2048
-#define PTY_GLIB_BUFFER_SIZE (16*1024)
+// Largest receive ring -r may ask for
+#define GSM0710_MAX_BUFFER_SIZE (16 * 1024 * 1024)
+// Received data a pty reader didn't take yet is kept for it up to this
+// size, the modem is told to hold back with FC from 3/4 on until it's
+// down to 1/4 again
+#define GSM0710_PTY_QUEUE_SIZE(n1) max(4096, 4 * (n1))
+// Room for the pts device name and the origin of a channel
+#define GSM0710_NAME_SIZE 64
+// Maximum number of frames queued for the serial port
+#define GSM0710_QUEUE_FRAMES 64
+// Frames of the transmit queue the ptys leave to the control channel
+#define GSM0710_QUEUE_RESERVE 4
+// Milliseconds to wait for the transmit queue to be written before the
+// modem is talked to directly
+#define GSM0710_DRAIN_TIMEOUT 1000
+// Milliseconds between looks whether the port can switch to the speed
+// agreed with RPN, all sent at the old speed must be out first
+#define GSM0710_RPN_POLL 5
+// Milliseconds to wait for the answer to the TEST sent at the speed agreed
+// with RPN before the port goes back to the old one
+#define GSM0710_RPN_TEST_TIMEOUT 1000
+// Watches of the epoll backend: serial port, watchdog and ptys, reading
+// and writing
+#define GSM0710_MAX_WATCHES (2 * GSM0710_MAX_CHANNELS + 4)
+// Maximum number of frames from one serial read written to the ptys at
+// once, with a writev() per channel
+#define GSM0710_RX_FRAMES 64
+// Bytes in front of each frame the serial I/O thread hands over:
+// channel, control and the length, low byte first
+#define GSM0710_RING_HEADER 4
+// Maximum number of commands of an AT script and the longest line of
+// the modem's answers kept, the rest of a line is dropped
+#define GSM0710_AT_SCRIPT 16
+#define GSM0710_AT_LINE 128
+// AT command flags: the answer doesn't matter, the modem may still be in
+// the mux-mode and is told to close it on failure, it may be sent before
+// the answer to the previous command (with -a)
+#define AT_MAY_FAIL 1
+#define AT_LEAVE_MUX 2
+#define AT_PIPELINE 4
+// Milliseconds to wait for the answer to a TEST frame when looking for a
+// mux-mode left by an earlier run, and how many are sent
+#define GSM0710_RESUME_TIMEOUT 200
+#define GSM0710_RESUME_TRIES 3
+// Largest frame size (N1) chosen from what +CMUX=? offers unless -f asks
+// for another
+#define GSM0710_MAX_N1 1024
+// Frame size proposed with PN for interactive channels, they don't wait
+// for large frames to be sent, bulk channels propose the mux-mode's
+#define GSM0710_INTERACTIVE_N1 64
+// Window sizes (k) proposed with PN
+#define GSM0710_INTERACTIVE_K 2
+#define GSM0710_BULK_K 7
+// Worst case size of an escaped advanced mode frame incl. wakeup sequence
+#define GSM0710_ADV_FRAME_SIZE(n1) (2 + ((n1) + 3) * 2 + 2)
 
 ////////////////////////////////////////////////////// types
 //
+// a received frame, the payload is not copied but stays in the receive
+// buffer, so it is only valid until the next frame is taken from there
 typedef struct GSM0710_Frame
 {
 	unsigned char channel;
@@ -126,19 +220,50 @@ typedef struct GSM0710_Frame
 	unsigned char *data;
 } GSM0710_Frame;
 
-//
+// Frames of all channels queued during one main loop iteration, encoded
+// back to back for a single write() to the serial port
+typedef struct GSM0710_Queue
+{
+	unsigned char *data;// in the session arena
+	int size;
+	int head;// bytes already written
+	int length;
+	int frame_end[GSM0710_QUEUE_FRAMES];// offset after the frame in data
+	int frame_start[GSM0710_QUEUE_FRAMES];// offset of the frame, after the flag opening it
+	signed char frame_i[GSM0710_QUEUE_FRAMES];// channel of an I frame, -1 for the others
+	int frame_count;
+} GSM0710_Queue;
+
+// Bytes passed between two threads without a lock, one of them only
+// writes, the other only reads. Mapped twice back to back like the
+// receive ring, so anything in it is contiguous. The indices run freely,
+// each is only moved by its own side.
+typedef struct GSM0710_Ring
+{
+	unsigned char *data;// 2 * size bytes, the second half mirrors the first
+	unsigned int size;// power of two
+	unsigned int head;// moved by the writer
+	unsigned int tail;// moved by the reader
+} GSM0710_Ring;
+
+// The receive ring. Its pages are mapped twice back to back, so size
+// bytes from any position are contiguous in memory and a frame never
+// wraps around. The indices run freely and are masked on access.
 typedef struct GSM0710_Buffer
 {
-	unsigned char data[GSM0710_BUFFER_SIZE];
-	unsigned char *readp;
-	unsigned char *writep;
-	unsigned char *endp;
+	unsigned char *data;// 2 * size bytes, the second half mirrors the first
+	unsigned long size;// power of two
+	unsigned long mask;
+	unsigned long readi;
+	unsigned long writei;
 	int flag_found;// set if last character read was flag
 	unsigned long received_count;
 	unsigned long dropped_count;
-	unsigned char adv_data[GSM0710_BUFFER_SIZE];
+	unsigned char *adv_data;// 2 * size bytes behind the mirror
+	int adv_start;// where the frame in progress starts in adv_data
 	int adv_length;
 	int adv_found_esc;
+	unsigned char adv_fcs;// running fcs over the unescaped frame
 } GSM0710_Buffer;
 
 // Channel data 
@@ -149,18 +274,64 @@ typedef struct Channel
 	int fd;
 	int opened;
 	int frames_allowed;
+	int throttled;// the modem asserted FC, the pty is not read
+	struct timespec throttled_since;
+	unsigned long throttled_ms;// time spent throttled
+	unsigned long throttle_count;
+	unsigned char *out;// GSM0710_PTY_QUEUE_SIZE bytes in the session arena
+	int out_size;
+	int out_head;
+	int out_length;
+	int out_fc;// we asserted FC towards the modem
+	unsigned long out_fc_count;
+	guint g_source_out;
 	unsigned char v24_signals;
-	char* ptsname;
-	char* origin;
+	char ptsname[GSM0710_NAME_SIZE];
+	char origin[GSM0710_NAME_SIZE];
+	int N1;// frame size agreed with PN, up to cmux_N1
+	int k;// window size agreed with PN
 	int remaining;
-	unsigned char *tmp;
+	unsigned char *tmp;// N1 bytes in the session arena
 	guint g_source;
 	GIOChannel* g_channel;
+	DBusGMethodInvocation* alloc_context;// AllocChannel call waiting for the UA
+	int alloc_retries;// SABMs sent again for it
+	guint g_source_alloc;// its retry timer
+	int closing;// DISC sent, the UA is awaited in the background
+	int close_retries;// DISCs sent again
+	guint g_source_close;// their timer
+	unsigned char *i_frames;// I frames not acknowledged yet, cmux_k of cmux_N1 bytes in the session arena
+	int i_length[GSM0710_MAX_K];// their lengths
+	int i_first;// slot of the one V(A) names
+	int vs;// V(S), N(S) of the next I frame sent
+	int va;// V(A), N(S) of the oldest I frame not acknowledged
+	int vr;// V(R), N(S) of the I frame expected next
+	int ack_pending;// RR to send, with GSM0710_PF when polled
+	int rej_sent;// until the I frame asked for with REJ arrives
+	int peer_busy;// the modem sent RNR
+	int t1_expiries;// T1 ran out without an acknowledgement
+	int i_unsent;// I frames still in the transmit queue, T1 waits for them
+	int in_batch;// bytes of I frames taken, not handed to the pty yet
+	int local_busy;// RNR sent, the pty queue is over the high watermark
+	int busy_dropped;// I frames dropped meanwhile, REJ asks for them again
+	guint g_source_t1;
+	unsigned long i_resent;// I frames sent again
 } Channel;
 
+// Memory of a mux session. Allocated at once when the serial device is
+// opened, handed out piecewise and released at once by close_devices()
+typedef struct Arena
+{
+	unsigned char *base;
+	size_t size;
+	size_t used;
+} Arena;
+
 typedef enum MuxerStates 
 {
 	MUX_STATE_OPENING,
+	MUX_STATE_RESUMING,// looking for a mux-mode left by an earlier run
+	MUX_STATE_POWERING,// power sequence, waiting for the modem to answer
 	MUX_STATE_INITILIZING,
 	MUX_STATE_MUXING,
 	MUX_STATE_CLOSING,
@@ -168,42 +339,184 @@ typedef enum MuxerStates
 	MUX_STATES_COUNT // keep this the last
 } MuxerStates;
 
+typedef enum AtResults
+{
+	AT_RESULT_NONE,// not a final result code
+	AT_RESULT_OK,
+	AT_RESULT_ERROR,
+	AT_RESULT_TIMEOUT,
+} AtResults;
+
+struct Serial;
+
+typedef struct AtCommand
+{
+	char text[GSM0710_NAME_SIZE];// without the line end
+	int timeout;// ms
+	int flags;
+	void (*response)(struct Serial* serial, const char *line);// lines before the result code, may be NULL
+} AtCommand;
+
+// Talks to the modem with AT commands from the main loop. What it sends
+// is split into lines, final result codes go to result()
+typedef struct AtEngine
+{
+	AtCommand script[GSM0710_AT_SCRIPT];
+	int count;
+	int sent;// commands written
+	int answered;// commands which got their final result code
+	char line[GSM0710_AT_LINE];
+	int line_length;
+	int discard;// drop the rest of what was read, it predates the script
+	void (*result)(struct Serial* serial, AtResults result);// NULL if not reading
+	void (*response)(struct Serial* serial, const char *line);// the other lines, may be NULL
+	void (*done)(struct Serial* serial, int result);// script finished, 0 or -1
+} AtEngine;
+
 typedef struct Serial
 {
 	char *devicename;
 	char* pm_base_dir;
 	int fd;
 	MuxerStates state;
+	Arena arena;
+	int arena_N1;// the frame size the session memory is sized for
+	int arena_k;// the window size it keeps I frames for, 0 without the error recovery mode
 	GSM0710_Buffer *in_buf;// input buffer
-	unsigned char *adv_frame_buf;
+	GSM0710_Queue tx_queue;// output queue, written when the port takes it
+	int tx_blocked;// the ptys aren't read until the queue has room again
+	unsigned long tx_frames;// frames written to the serial port
+	unsigned long tx_flushes;// queues written for them
+	unsigned long tx_syscalls;// write calls needed for them
+	unsigned long tx_bytes;
+	unsigned long rx_bytes;// read from the serial port, by the serial I/O thread if it runs
+	int speed;// baud rate of the serial port
+	struct timespec speed_since;// when it was set
+	unsigned long speed_tx_bytes;// tx_bytes by then
+	unsigned long speed_rx_bytes;// rx_bytes by then
+	int rpn_asked;// RPN value asked for with -S, -1 if none
+	int rpn_switch;// speed agreed with RPN the port didn't switch to yet, 0 if none
+	int rpn_old_bytes;// queued bytes still to go at the old speed
+	struct timespec rpn_since;// when the modem agreed
+	guint g_source_rpn;// looks whether the switch can be made, or waits for the TEST after it
+	int rpn_testing;// speed to go back to if the TEST isn't answered, 0 if none
+	int64_t link_active;// ms of CLOCK_MONOTONIC, last byte sent or received
+	int modem_asleep;// the modem announced sleep with PSC
+	unsigned long tx_wakeups;// wakeup sequences sent
+	unsigned long tx_wakeups_suppressed;// not needed as the link was busy
+	unsigned long rx_pty_frames;// frames written to the ptys
+	unsigned long rx_pty_syscalls;// write calls needed for them
+	unsigned long tx_payload;// channel data sent
+	unsigned long rx_payload;// channel data received
+	unsigned long loop_wakeups;// polls of the main loop which slept
+	long loop_busy_max;// longest time in us the main loop didn't poll
+	struct timespec started;// when the mux-mode started
+	double cpu_started;// CPU time in ms used by then
 	time_t frame_receive_time;
 	int ping_number;
+	guint g_source_boot;// next step of the power sequence or the mux-mode start
+	guint g_source_probe;// the answer to the AT probes and commands
+	AtEngine at;
+	AtCommand* at_cmux;// AT+CMUX= in the script, its parameters are filled in when chosen
+	char modem_id[GSM0710_AT_LINE];// what ATI and +CGMR told
+	int cache_hit;// the mux parameters came from the cache
+	int boot_step;
+	int resume_tries;// TEST frames sent to find an earlier mux-mode, -1 when done
+	int probe_delay;// ms until the next AT probe
+	struct timespec boot_started;// power on started
+	long boot_first_at;// ms until the modem answered AT, -1 before
+	long boot_cmux;// ms until the mux-mode was started
+	long boot_first_channel;// ms until the first channel was open
+	GIOChannel* g_channel;
 	guint g_source;
+	guint g_source_out;
 	guint g_source_watchdog;
 } Serial;
 
+// A watch of the epoll backend, the counterpart of g_io_add_watch()
+typedef struct MuxWatch
+{
+	guint id;// 0 if the slot is free
+	GIOChannel* channel;
+	int fd;
+	GIOCondition condition;
+	GIOFunc func;
+	gpointer data;
+} MuxWatch;
+
+// The serial I/O thread. While muxing it owns the serial port and the
+// receive buffer, gets the encoded frames from the main loop through tx
+// and hands the decoded ones back through rx. It calls no GLib
+// functions.
+typedef struct SerialThread
+{
+	pthread_t thread;
+	int running;
+	int stop;// set by the main loop to end the thread
+	int hangup;// set by the thread if the serial port went away
+	int wake_fd;// eventfd the thread polls
+	int notify_fd;// eventfd the main loop watches
+	GIOChannel* notify_channel;
+	GSM0710_Ring tx;
+	GSM0710_Ring rx;
+	unsigned int rx_next;// next frame in rx for the main loop
+	int tx_waiting;// the main loop waits for room in tx
+	int rx_waiting;// the thread waits for room in rx
+	unsigned long rx_full;// times the thread waited for the main loop
+	unsigned long wakeups;// polls of the thread
+	unsigned long syscalls;// write calls of the thread
+	long busy_max;// longest time in us the thread didn't poll
+} SerialThread;
+
+// Timing of a modem's power sequence in ms. The fixed delays are
+// upper bounds, after the reset the modem is probed with AT with a
+// backoff from probe_first to probe_max until it answers.
+typedef struct ModemProfile
+{
+	const char* name;
+	int off_delay;// power and reset low before power on
+	int power_delay;// power on until reset
+	int reset_pulse;// length of the reset pulse
+	int probe_first;
+	int probe_max;
+	int boot_timeout;// the modem is power cycled if it doesn't answer by then
+	int cmux_settle;// AT+CMUX answered until the control channel is opened
+} ModemProfile;
+
 /////////////////////////////////////////// function prototypes
 /**
- * increases buffer pointer by one and wraps around if necessary
+ * where the unread data starts, gsm0710_buffer_length() bytes are
+ * contiguous from there
+ */
+//unsigned char *gsm0710_buffer_readp(GSM0710_Buffer *buf);
+#define gsm0710_buffer_readp(buf) (buf->data + (buf->readi & buf->mask))
+/**
+ * where new data goes, gsm0710_buffer_free() bytes are contiguous from
+ * there
  */
-//void gsm0710_buffer_inc(GSM0710_Buffer *buf, void&* p);
-#define gsm0710_buffer_inc(buf,p) do { p++; if (p == buf->endp) p = buf->data; } while (0)
+//unsigned char *gsm0710_buffer_writep(GSM0710_Buffer *buf);
+#define gsm0710_buffer_writep(buf) (buf->data + (buf->writei & buf->mask))
 /**
  * Tells how many chars are saved into the buffer.
  */
 //int gsm0710_buffer_length(GSM0710_Buffer *buf);
-#define gsm0710_buffer_length(buf) ((buf->readp > buf->writep) ? (GSM0710_BUFFER_SIZE - (buf->readp - buf->writep)) : (buf->writep-buf->readp))
+#define gsm0710_buffer_length(buf) ((int)(buf->writei - buf->readi))
 /**
  * tells how much free space there is in the buffer
  */
 //int gsm0710_buffer_free(GSM0710_Buffer *buf);
-#define gsm0710_buffer_free(buf) ((buf->readp > buf->writep) ? (buf->readp - buf->writep) : (GSM0710_BUFFER_SIZE - (buf->writep-buf->readp)) - 1)
+#define gsm0710_buffer_free(buf) ((int)(buf->size - (buf->writei - buf->readi)))
 
 ////////////////////////////////// constants & globals
 static unsigned char close_channel_cmd[] = { GSM0710_CONTROL_CLD | GSM0710_CR, GSM0710_EA | (0 << 1) };
 static unsigned char test_channel_cmd[] = { GSM0710_CONTROL_TEST | GSM0710_CR, GSM0710_EA | (6 << 1), 'P', 'I', 'N', 'G', '\r', '\n', };
 //static unsigned char psc_channel_cmd[] = { GSM0710_CONTROL_PSC | GSM0710_CR, GSM0710_EA | (0 << 1), };
 static unsigned char wakeup_sequence[] = { GSM0710_FRAME_FLAG, GSM0710_FRAME_FLAG, };
+// advanced mode bytes to be escaped, must match GSM0710_FRAME_ADV_ESCAPED_SYMS
+static const unsigned char adv_escape_table[256] = {
+	[GSM0710_FRAME_ADV_FLAG] = 1, [GSM0710_FRAME_ADV_ESC] = 1,
+	[0x11] = 1, [0x91] = 1, [0x13] = 1, [0x93] = 1,
+};
 // crc table from gsm0710 spec
 static const unsigned char r_crctable[] = {//reversed, 8-bit, poly=0x07
 	0x00, 0x91, 0xE3, 0x72, 0x07, 0x96, 0xE4, 0x75, 0x0E, 0x9F, 0xED,
@@ -238,21 +551,64 @@ static int pin_code = -1;
 static int use_ping = 0;
 static int use_timeout = 0;
 static int syslog_level = LOG_INFO;
+static int buffer_size = GSM0710_BUFFER_SIZE;
+static int wakeup_idle = 1000;// ms
+// power sequence timing, selected with -D
+static const ModemProfile modem_profiles[] = {
+	{ "default", 1000, 1000, 1000, 50, 500, 10000, 1000, },
+	{ "fast", 100, 100, 100, 20, 200, 10000, 100, },
+};
+static ModemProfile modem_profile = { "default", 1000, 1000, 1000, 50, 500, 10000, 1000, };
+// the serial port and the ptys are watched with edge-triggered epoll,
+// GLib only polls the epoll fd besides D-Bus
+static int use_epoll = 0;
+static int epoll_fd = -1;
+static MuxWatch watches[GSM0710_MAX_WATCHES];
+static guint watch_last_id = 0;
+static int watchdog_fd = -1;// timerfd of the epoll backend
+static GIOChannel* watchdog_channel = NULL;
+static int watchdog_armed = 0;
+// a thread of its own services the serial port, so the main loop can't
+// hold it up
+static int use_thread = 0;
+static SerialThread serial_thread;
+// AT commands marked for it are sent without waiting for the answer to
+// the previous one
+static int at_pipeline = 0;
+// the modem is left in the mux-mode on exit and it is taken over on the
+// next start
+static int use_resume = 0;
+// the mux parameters which worked with a modem are kept in this key
+// file, so they needn't be found out again
+static char* cache_file = NULL;
 static char* object_name = "/org/pyneo/Muxer";
 // serial io
 static Serial serial;
 // muxed io channels
 static Channel channellist[GSM0710_MAX_CHANNELS]; // remember: [0] is not used acticly because it's the control channel
 // some state
-static GMainLoop* main_loop = NULL;
+static volatile sig_atomic_t main_running = 1;
 static DBusGConnection* g_conn = NULL;
 // +CMUX=<mode>[,<subset>[,<port_speed>[,<N1>[,<T1>[,<N2>[,<T2>[,<T3>[,<k>]]]]]]]]
+// set with -m, -E and -b, each start chooses from them what the modem has
+static int cmux_mode_wanted = 1;
+static int cmux_subset_wanted = 0;
+static int cmux_port_speed_wanted = 5;
+// chosen for the current start
 static int cmux_mode = 1;
 static int cmux_subset = 0;
 static int cmux_port_speed = 5;
 // Maximum Frame Size (N1): 64/31
-static int cmux_N1 = 64;
-#if 0
+#define GSM0710_DEFAULT_N1 64
+static int cmux_N1 = GSM0710_DEFAULT_N1;
+// set with -f, otherwise the largest N1 the modem allows is chosen
+static int cmux_N1_limit = 0;
+// set with -S, the port speed asked for with RPN once muxing
+static int rpn_speed = 0;
+// AllocChannel origins containing one of these get a bulk data channel,
+// the others an interactive one
+static const char* bulk_origins[] = {"ppp", "gprs", "pdp", "data", NULL};
+// the following are sent with +CMUX for the error recovery mode only
 // Acknowledgement Timer (T1) sec/100: 10 
 static int cmux_T1 = 10;
 // Maximum number of retransmissions (N2): 3
@@ -263,21 +619,80 @@ static int cmux_T2 = 30;
 static int cmux_T3 = 10;
 // Window Size (k): 2
 static int cmux_k = 2;
+#ifdef GSM0710_ALLOC_CHECK
+// Counts all heap allocations of the process (glib and dbus included)
+// while the data path is running, which has to stay at zero when muxing.
+// Build with ./configure --enable-alloc-check
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+// volatile as the compiler assumes malloc() leaves our globals alone
+static volatile int alloc_check_active = 0;
+static volatile unsigned long alloc_check_count = 0;
+static unsigned long alloc_check_reported = 0;
+void *malloc(size_t size)
+{
+	alloc_check_count += alloc_check_active;
+	return __libc_malloc(size);
+}
+void *calloc(size_t nmemb, size_t size)
+{
+	alloc_check_count += alloc_check_active;
+	return __libc_calloc(nmemb, size);
+}
+void *realloc(void *ptr, size_t size)
+{
+	alloc_check_count += alloc_check_active;
+	return __libc_realloc(ptr, size);
+}
+#define ALLOC_CHECK_ENTER() do { alloc_check_active = 1; } while (0)
+#define ALLOC_CHECK_LEAVE() do { alloc_check_active = 0;\
+ if (alloc_check_count != alloc_check_reported) {\
+ LOG(LOG_WARNING, "%lu heap allocations on the data path", alloc_check_count - alloc_check_reported);\
+ alloc_check_reported = alloc_check_count;\
+ }} while (0)
+#else
+#define ALLOC_CHECK_ENTER() do { } while (0)
+#define ALLOC_CHECK_LEAVE() do { } while (0)
 #endif
-// TODO: set automatically from at+cmux=?
+// +CMUX=? tells what the modem supports, e.g.
 // neo: +CMUX: (1),(0),(1-5),(10-100),(1-255),(0-100),(2-255),(1-255),(1-7)
 
 /*
  * The following arrays must have equal length and the values must
  * correspond. also it has to correspond to the gsm0710 spec regarding
- * baud id of CMUX the command.
+ * baud id of CMUX the command. The ids from 7 on are beyond the spec,
+ * modems taking them tell so in +CMUX=?. Rates without a B constant
+ * are set with BOTHER.
  */
 static int baud_rates[] = {
-	0, 9600, 19200, 38400, 57600, 115200, 230400, 460800
+	0, 9600, 19200, 38400, 57600, 115200, 230400, 460800, 921600, 1843200, 3000000, 4000000
 };
 static speed_t baud_bits[] = {
-	0, B9600, B19200, B38400, B57600, B115200, B230400, B460800
+	0, B9600, B19200, B38400, B57600, B115200, B230400, B460800, B921600, 0, B3000000, B4000000
 };
+// Baud rates of RPN, the index is the value sent
+static int rpn_rates[] = {
+	2400, 4800, 7200, 9600, 19200, 38400, 57600, 115200, 230400
+};
+#ifdef TCGETS2
+// The termios of the kernel with the rates in numbers, glibc doesn't
+// have it and the kernel headers clash with glibc's
+struct termios2
+{
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t c_line;
+	cc_t c_cc[19];
+	speed_t c_ispeed;
+	speed_t c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER 0010000
+#endif
+#endif
 
 /**
  * Determine baud-rate index for CMUX command
@@ -292,6 +707,19 @@ static int baud_rate_index(
 	return -1;
 }
 
+/**
+ * Determine the value of a baud-rate for RPN
+ */
+static int rpn_rate_index(
+	int baud_rate)
+{
+	int i;
+	for (i = 0; i < sizeof(rpn_rates) / sizeof(*rpn_rates); ++i)
+		if (rpn_rates[i] == baud_rate)
+			return i;
+	return -1;
+}
+
 gboolean glib_returnfalse(
        gpointer data)
 {
@@ -318,6 +746,111 @@ static unsigned char frame_calc_crc(
 	return 0xFF - fcs;
 }
 
+/**
+ * Calculates the frame check sequence of a frame to be sent, over its
+ * data as well unless it's an UIH frame.
+ *
+ * PARAMS:
+ * prefix - address, control and in basic mode length
+ * prefix_length - their length
+ * input - the data
+ * length - its length
+ * RETURNS:
+ * frame check sequence
+ */
+static unsigned char frame_fcs(
+	const unsigned char *prefix,
+	int prefix_length,
+	const unsigned char *input,
+	int length)
+{
+	unsigned char fcs = 0xFF;
+	int i;
+	for (i = 0; i < prefix_length; i++)
+		fcs = r_crctable[fcs ^ prefix[i]];
+	if (GSM0710_FCS_DATA(prefix[1]))
+		for (i = 0; i < length; i++)
+			fcs = r_crctable[fcs ^ input[i]];
+	return 0xFF - fcs;
+}
+
+/**
+ * Tells if the mux-mode numbers its frames and repeats the lost ones.
+ */
+static int error_recovery()
+{
+	return cmux_subset == GSM0710_SUBSET_I;
+}
+
+#ifdef GSM0710_ADV_ESCAPE_BLOCK
+/**
+ * Tells how many of the GSM0710_ADV_ESCAPE_BLOCK bytes at data don't
+ * need escaping (GSM0710_ADV_ESCAPE_BLOCK if none does).
+ */
+static inline int adv_escape_clean(
+	const unsigned char *data)
+{
+#if defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *)data);
+	__m128i m = _mm_or_si128(
+		_mm_cmpeq_epi8(v, _mm_set1_epi8(GSM0710_FRAME_ADV_FLAG)),
+		_mm_cmpeq_epi8(v, _mm_set1_epi8(GSM0710_FRAME_ADV_ESC)));
+//0x11, 0x13, 0x91 and 0x93 are the only bytes with (c & 0x7D) == 0x11
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(0x7D)), _mm_set1_epi8(0x11)));
+	int mask = _mm_movemask_epi8(m);
+	return mask ? __builtin_ctz(mask) : GSM0710_ADV_ESCAPE_BLOCK;
+#else
+	uint8x16_t v = vld1q_u8(data);
+	uint8x16_t m = vorrq_u8(
+		vceqq_u8(v, vdupq_n_u8(GSM0710_FRAME_ADV_FLAG)),
+		vceqq_u8(v, vdupq_n_u8(GSM0710_FRAME_ADV_ESC)));
+	m = vorrq_u8(m, vceqq_u8(vandq_u8(v, vdupq_n_u8(0x7D)), vdupq_n_u8(0x11)));
+	uint64x2_t m64 = vreinterpretq_u64_u8(m);
+	int i = 0;
+	if ((vgetq_lane_u64(m64, 0) | vgetq_lane_u64(m64, 1)) == 0)
+		return GSM0710_ADV_ESCAPE_BLOCK;
+	while (!adv_escape_table[data[i]])
+		i++;
+	return i;
+#endif
+}
+#endif
+
+/**
+ * Tells how many bytes at data are neither an advanced mode flag nor an
+ * escape symbol, i.e. can be taken over by the decoder as they are.
+ */
+static inline int adv_unescape_clean(
+	const unsigned char *data,
+	int length)
+{
+	int i = 0;
+#if defined(__SSE2__)
+	for (; i + GSM0710_ADV_ESCAPE_BLOCK <= length; i += GSM0710_ADV_ESCAPE_BLOCK)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+		int mask = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(GSM0710_FRAME_ADV_FLAG)),
+			_mm_cmpeq_epi8(v, _mm_set1_epi8(GSM0710_FRAME_ADV_ESC))));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(GSM0710_ADV_ESCAPE_BLOCK)
+	for (; i + GSM0710_ADV_ESCAPE_BLOCK <= length; i += GSM0710_ADV_ESCAPE_BLOCK)
+	{
+		uint8x16_t v = vld1q_u8(data + i);
+		uint64x2_t m64 = vreinterpretq_u64_u8(vorrq_u8(
+			vceqq_u8(v, vdupq_n_u8(GSM0710_FRAME_ADV_FLAG)),
+			vceqq_u8(v, vdupq_n_u8(GSM0710_FRAME_ADV_ESC))));
+		if (vgetq_lane_u64(m64, 0) | vgetq_lane_u64(m64, 1))
+			break;
+	}
+#endif
+	while (i < length && data[i] != GSM0710_FRAME_ADV_FLAG && data[i] != GSM0710_FRAME_ADV_ESC)
+		i++;
+	return i;
+}
+
 /**
  * Escapes GSM0710_FRAME_ADV_ESCAPED_SYMS characters.
  * returns escaped buffer length.
@@ -327,20 +860,31 @@ static int fill_adv_frame_buf(
 	const unsigned char *data,
 	int length)
 {
-	static const unsigned char esc[] = GSM0710_FRAME_ADV_ESCAPED_SYMS;
-	int i, esc_i, adv_i = 0;
-	for (i = 0; i < length; ++i, ++adv_i)
+	int i = 0, adv_i = 0;
+#ifdef GSM0710_ADV_ESCAPE_BLOCK
+//copy clean blocks in bulk, escape only where the vector compare hit
+	while (i + GSM0710_ADV_ESCAPE_BLOCK <= length)
 	{
-		adv_buf[adv_i] = data[i];
-		for (esc_i = 0; esc_i < sizeof(esc) / sizeof(esc[0]); ++esc_i)
-			if (data[i] == esc[esc_i])
-			{
-				adv_buf[adv_i] = GSM0710_FRAME_ADV_ESC;
-				adv_i++;
-				adv_buf[adv_i] = data[i] ^ GSM0710_FRAME_ADV_ESC_COPML;
-				break;
-			}
+		int clean = adv_escape_clean(data + i);
+		memcpy(adv_buf + adv_i, data + i, clean);
+		i += clean;
+		adv_i += clean;
+		if (clean < GSM0710_ADV_ESCAPE_BLOCK)
+		{
+			adv_buf[adv_i++] = GSM0710_FRAME_ADV_ESC;
+			adv_buf[adv_i++] = data[i++] ^ GSM0710_FRAME_ADV_ESC_COPML;
+		}
 	}
+#endif
+	for (; i < length; ++i, ++adv_i)
+		if (adv_escape_table[data[i]])
+		{
+			adv_buf[adv_i] = GSM0710_FRAME_ADV_ESC;
+			adv_i++;
+			adv_buf[adv_i] = data[i] ^ GSM0710_FRAME_ADV_ESC_COPML;
+		}
+		else
+			adv_buf[adv_i] = data[i];
 	return adv_i;
 }
 
@@ -387,8 +931,355 @@ static int syslogdump(
 }
 
 /**
- * Writes a frame to a logical channel. C/R bit is set to 1.
- * Doesn't support FCS counting for GSM0710_TYPE_UI frames.
+ * Hands out memory from the session arena, which is never freed
+ * separately.
+ *
+ * RETURNS:
+ * size bytes or NULL if the arena is exhausted
+ */
+static void *arena_alloc(
+	Arena *arena,
+	size_t size)
+{
+	void *p;
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (arena->used + size > arena->size)
+	{
+		LOG(LOG_ALERT, "Session arena exhausted, %d of %d bytes used", (int)arena->used, (int)arena->size);
+		return NULL;
+	}
+	p = arena->base + arena->used;
+	arena->used += size;
+	return p;
+}
+
+/**
+ * Notes traffic on the serial link, in any direction.
+ */
+static void link_touch(
+	Serial *serial)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+//the serial I/O thread notes received data as well
+	__atomic_store_n(&serial->link_active, (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000, __ATOMIC_RELAXED);
+}
+
+/**
+ * CPU time used by the process in ms.
+ */
+static double cpu_time()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e3
+		+ (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e3;
+}
+
+/**
+ * The conditions the watches of a fd ask for together.
+ */
+static GIOCondition mux_watch_condition(
+	int fd)
+{
+	GIOCondition condition = 0;
+	int i;
+	for (i = 0; i < GSM0710_MAX_WATCHES; i++)
+		if (watches[i].id != 0 && watches[i].fd == fd)
+			condition |= watches[i].condition;
+	return condition;
+}
+
+/**
+ * Tells the epoll set which events of a fd the watches ask for. The fd
+ * goes in and out of the set as its watches come and go.
+ *
+ * PARAMS:
+ * fd - the fd
+ * before - the conditions asked for before the watches changed
+ */
+static void mux_watch_update(
+	int fd,
+	GIOCondition before)
+{
+	struct epoll_event event;
+	GIOCondition now = mux_watch_condition(fd);
+	int op;
+	if (now == before)
+		return;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLET
+		| ((now & G_IO_IN) ? EPOLLIN : 0)
+		| ((now & G_IO_OUT) ? EPOLLOUT : 0);
+	event.data.fd = fd;
+	op = now == 0 ? EPOLL_CTL_DEL : before == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(epoll_fd, op, fd, &event) < 0)
+		LOG(LOG_WARNING, "Couldn't watch fd %d: '%s' (code: %d)", fd, strerror(errno), errno);
+}
+
+/**
+ * Watches a fd of the data plane, with GLib or the epoll backend. Used
+ * like g_io_add_watch(). The epoll backend is edge-triggered, so func
+ * has to read or write until the fd would block or it won't hear of it
+ * again.
+ *
+ * RETURNS:
+ * id of the watch, for mux_watch_remove()
+ */
+static guint mux_watch_add(
+	GIOChannel* channel,
+	GIOCondition condition,
+	GIOFunc func,
+	gpointer data)
+{
+	int fd, i;
+	GIOCondition before;
+	if (!use_epoll)
+		return g_io_add_watch(channel, condition, func, data);
+	fd = g_io_channel_unix_get_fd(channel);
+	before = mux_watch_condition(fd);
+	for (i = 0; i < GSM0710_MAX_WATCHES && watches[i].id != 0; i++)
+		;
+	if (i == GSM0710_MAX_WATCHES)
+	{
+		LOG(LOG_ALERT, "Out of watches for fd %d", fd);
+		return -1;
+	}
+//ids are unique, a stale one never removes a new watch
+	if (++watch_last_id == 0 || watch_last_id == (guint)-1)
+		watch_last_id = 1;
+	watches[i].id = watch_last_id;
+	watches[i].channel = channel;
+	watches[i].fd = fd;
+	watches[i].condition = condition;
+	watches[i].func = func;
+	watches[i].data = data;
+	mux_watch_update(fd, before);
+	return watches[i].id;
+}
+
+/**
+ * Removes a watch of mux_watch_add(), like g_source_remove().
+ */
+static void mux_watch_remove(
+	guint id)
+{
+	int fd, i;
+	GIOCondition before;
+	if (!use_epoll)
+	{
+		g_source_remove(id);
+		return;
+	}
+	if (id == 0)
+		return;
+	for (i = 0; i < GSM0710_MAX_WATCHES && watches[i].id != id; i++)
+		;
+	if (i == GSM0710_MAX_WATCHES)
+		return;
+	fd = watches[i].fd;
+	before = mux_watch_condition(fd);
+	watches[i].id = 0;
+	mux_watch_update(fd, before);
+}
+
+/**
+ * Has the epoll backend report a fd again which is still readable or
+ * writable, for a watch which stopped before it would block. GLib
+ * watches are level-triggered and don't need it.
+ */
+static void mux_watch_rearm(
+	guint id)
+{
+	struct epoll_event event;
+	GIOCondition condition;
+	int i;
+	if (!use_epoll || id == 0)
+		return;
+	for (i = 0; i < GSM0710_MAX_WATCHES && watches[i].id != id; i++)
+		;
+	if (i == GSM0710_MAX_WATCHES)
+		return;
+//the set checks the readiness again whenever a fd is modified
+	condition = mux_watch_condition(watches[i].fd);
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLET
+		| ((condition & G_IO_IN) ? EPOLLIN : 0)
+		| ((condition & G_IO_OUT) ? EPOLLOUT : 0);
+	event.data.fd = watches[i].fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, watches[i].fd, &event) < 0)
+		LOG(LOG_WARNING, "Couldn't watch fd %d: '%s' (code: %d)", watches[i].fd, strerror(errno), errno);
+}
+
+/**
+ * Dispatches the events of the epoll set to the watches, GLib calls it
+ * when the epoll fd becomes readable.
+ */
+static gboolean epoll_dispatch(
+	GIOChannel *source,
+	GIOCondition condition,
+	gpointer data)
+{
+	struct epoll_event events[GSM0710_MAX_WATCHES];
+	GIOCondition revents;
+	guint id;
+	int count, i, w;
+	if ((count = epoll_wait(epoll_fd, events, GSM0710_MAX_WATCHES, 0)) < 0)
+	{
+		if (errno != EINTR)
+			LOG(LOG_WARNING, "epoll_wait failed: '%s' (code: %d)", strerror(errno), errno);
+		return TRUE;
+	}
+	for (i = 0; i < count; i++)
+	{
+		revents = ((events[i].events & EPOLLIN) ? G_IO_IN : 0)
+			| ((events[i].events & EPOLLOUT) ? G_IO_OUT : 0)
+			| ((events[i].events & EPOLLHUP) ? G_IO_HUP : 0)
+			| ((events[i].events & EPOLLERR) ? G_IO_ERR : 0);
+//a callback may remove and add watches, a stale event only costs a
+//read or write that would block
+		for (w = 0; w < GSM0710_MAX_WATCHES; w++)
+			if (watches[w].id != 0 && watches[w].fd == events[i].data.fd
+			&& (watches[w].condition & revents))
+			{
+				id = watches[w].id;
+				if (!watches[w].func(watches[w].channel, watches[w].condition & revents, watches[w].data))
+					mux_watch_remove(id);
+			}
+	}
+	return TRUE;
+}
+
+/**
+ * Milliseconds passed since a time of CLOCK_MONOTONIC.
+ */
+static long ms_since(
+	const struct timespec *then)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/**
+ * Notes a step of the modem bring-up in the boot timeline, the first
+ * time it is reached after power on.
+ *
+ * PARAMS:
+ * serial - the serial port
+ * slot - where the time goes
+ * step - its name for the log
+ */
+static void boot_mark(
+	Serial* serial,
+	long *slot,
+	const char *step)
+{
+	if (*slot >= 0)
+		return;
+	*slot = ms_since(&serial->boot_started);
+	LOG(LOG_INFO, "Boot timeline: %s after %ld ms", step, *slot);
+	if (slot == &serial->boot_first_channel)
+		LOG(LOG_INFO, "Boot timeline: first AT answer %ld ms, mux-mode %ld ms, first channel %ld ms",
+			serial->boot_first_at, serial->boot_cmux, serial->boot_first_channel);
+}
+
+/**
+ * Tells if the modem may have fallen asleep, so the wakeup sequence has
+ * to go in front of the next frames: the link was idle for more than
+ * wakeup_idle ms or the modem announced sleep with PSC.
+ */
+static int link_needs_wakeup(
+	Serial *serial)
+{
+	struct timespec now;
+	int64_t idle;
+	if (serial->modem_asleep)
+		return 1;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	idle = (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000
+		- __atomic_load_n(&serial->link_active, __ATOMIC_RELAXED);
+	return idle >= wakeup_idle;
+}
+
+/**
+ * Logs the throughput of the serial link at its current speed against
+ * the nominal one, a byte takes 10 bits with 8N1.
+ */
+static void link_throughput(
+	Serial *serial)
+{
+	struct timespec now;
+	double secs, nominal;
+	unsigned long tx, rx;
+	if (serial->speed <= 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	secs = now.tv_sec - serial->speed_since.tv_sec + (now.tv_nsec - serial->speed_since.tv_nsec) / 1e9;
+	tx = serial->tx_bytes - serial->speed_tx_bytes;
+	rx = __atomic_load_n(&serial->rx_bytes, __ATOMIC_RELAXED) - serial->speed_rx_bytes;
+	if (tx == 0 && rx == 0)
+		return;
+	nominal = serial->speed / 10.0;
+	secs = max(secs, 1e-3);
+	LOG(LOG_INFO, "At %d baud for %.1f s sent %.0f and received %.0f bytes/s, %.1f%% and %.1f%% of the nominal %.0f bytes/s",
+		serial->speed, secs, tx / secs, rx / secs, tx / secs * 100 / nominal, rx / secs * 100 / nominal, nominal);
+}
+
+/**
+ * Sets the speed of the serial port once what was written before went
+ * out. Rates without a B constant are set with BOTHER.
+ *
+ * PARAMS:
+ * serial - the serial port
+ * rate - baud rate
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+static int serial_set_speed(
+	Serial *serial,
+	int rate)
+{
+	struct termios t;
+	int i = baud_rate_index(rate);
+	if (i > 0 && baud_bits[i] != 0)
+	{
+		SYSCHECK(tcgetattr(serial->fd, &t));
+		cfsetispeed(&t, baud_bits[i]);
+		cfsetospeed(&t, baud_bits[i]);
+		SYSCHECK(tcsetattr(serial->fd, TCSANOW, &t));
+	}
+	else
+	{
+#ifdef TCGETS2
+		struct termios2 t2;
+		SYSCHECK(ioctl(serial->fd, TCGETS2, &t2));
+		t2.c_cflag &= ~CBAUD;
+#ifdef CIBAUD
+		t2.c_cflag &= ~CIBAUD;
+#endif
+		t2.c_cflag |= BOTHER;
+		t2.c_ispeed = t2.c_ospeed = rate;
+		SYSCHECK(ioctl(serial->fd, TCSETS2, &t2));
+#else
+		LOG(LOG_ERR, "No support for %d baud", rate);
+		return -1;
+#endif
+	}
+	link_throughput(serial);
+	serial->speed = rate;
+	clock_gettime(CLOCK_MONOTONIC, &serial->speed_since);
+	serial->speed_tx_bytes = serial->tx_bytes;
+	serial->speed_rx_bytes = __atomic_load_n(&serial->rx_bytes, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Appends a frame for a logical channel to the transmit queue. C/R bit
+ * is set to 1, but for RR, RNR and REJ which only go as responses. The
+ * frame is encoded right away, so input may go away afterwards. In
+ * advanced mode the closing flag of a frame opens the next one.
  *
  * PARAMS:
  * channel - channel number (0 = control)
@@ -397,190 +1288,656 @@ static int syslogdump(
  * type - the type of the frame (with possible P/F-bit)
  *
  * RETURNS:
- * number of characters written
+ * number of characters queued, -1 if the queue is full
  */
-static int write_frame(
+static int tx_queue_frame(
 	int channel,
 	const unsigned char *input,
 	int length,
 	unsigned char type)
 {
-	LOG(LOG_DEBUG, "Enter");
-//flag, GSM0710_EA=1 C channel, frame type, length 1-2
-	unsigned char prefix[5] = { GSM0710_FRAME_FLAG, GSM0710_EA | GSM0710_CR, 0, 0, 0 };
-	unsigned char postfix[2] = { 0xFF, GSM0710_FRAME_FLAG };
-	int prefix_length = 4;
-	int c;
-//	char w = 0;
-//	int count = 0;
-//	do
-//	{
-		syslogdump(">s ", (unsigned char *)wakeup_sequence, sizeof(wakeup_sequence));
-		write(serial.fd, wakeup_sequence, sizeof(wakeup_sequence));
-//		SYSCHECK(tcdrain(serial.fd));
-//		fd_set rfds;
-//		FD_ZERO(&rfds);
-//		FD_SET(serial.fd, &rfds);
-//		struct timeval timeout;
-//		timeout.tv_sec = 0;
-//		timeout.tv_usec = 1000 / 100 * cmux_T2;
-//		int sel = select(serial.fd + 1, &rfds, NULL, NULL, &timeout);
-//		if (sel > 0 && FD_ISSET(serial.fd, &rfds))
-//			read(serial.fd, &w, 1);
-//		else
-//			count++;
-//	} while (w != wakeup_sequence[0] && count < cmux_N2);
-//	if (w != wakeup_sequence[0])
-//		LOG(LOG_WARNING, "Didn't get frame-flag after wakeup");
-	LOG(LOG_DEBUG, "Sending frame to channel %d", channel);
+	GSM0710_Queue *queue = &serial.tx_queue;
+	unsigned char prefix[4];// address, control, length 1-2
+	unsigned char fcs;
+	unsigned char *p;
+	int i, N1 = channellist[channel].N1 > 0 ? channellist[channel].N1 : cmux_N1;
+//let's not use too big frames, neither larger ones than agreed for the channel
+	length = min(N1, length);
+	if (queue->data == NULL || queue->frame_count >= GSM0710_QUEUE_FRAMES)
+		return -1;
+	if (queue->length + GSM0710_ADV_FRAME_SIZE(length) > queue->size && queue->head > 0)
+	{
+//move what wasn't written yet to the front
+		memmove(queue->data, queue->data + queue->head, queue->length - queue->head);
+		for (i = 0; i < queue->frame_count; i++)
+		{
+			queue->frame_start[i] -= queue->head;
+			queue->frame_end[i] -= queue->head;
+		}
+		queue->length -= queue->head;
+		queue->head = 0;
+	}
+	if (queue->length + GSM0710_ADV_FRAME_SIZE(length) > queue->size)
+		return -1;
+	p = queue->data + queue->length;
+	if (queue->length == 0)
+	{
+		if (link_needs_wakeup(&serial))
+		{
+			memcpy(p, wakeup_sequence, sizeof(wakeup_sequence));
+			p += sizeof(wakeup_sequence);
+			serial.tx_wakeups++;
+		}
+		else
+			serial.tx_wakeups_suppressed++;
+	}
+//the closing flag of the last frame at the old speed can't open the
+//first one at the new speed
+	if (cmux_mode && (queue->length == 0
+		|| (serial.rpn_switch && queue->length - queue->head == serial.rpn_old_bytes)))
+		*p++ = GSM0710_FRAME_ADV_FLAG;
+	queue->frame_start[queue->frame_count] = p - queue->data;
+	queue->frame_i[queue->frame_count] = (type & 1) == GSM0710_TYPE_I ? channel : -1;
 //GSM0710_EA=1, Command, let's add address
-	prefix[1] = prefix[1] | ((63 & (unsigned char) channel) << 2);
+	prefix[0] = GSM0710_EA | ((type & 3) == GSM0710_TYPE_RR ? 0 : GSM0710_CR) | ((63 & (unsigned char) channel) << 2);
 //let's set control field
-	prefix[2] = type;
-//let's not use too big frames
-	length = min(cmux_N1, length);
+	prefix[1] = type;
 	if (!cmux_mode)
 	{
+		int prefix_length = 3;
 //Modified acording PATCH CRC checksum
-//postfix[0] = frame_calc_crc (prefix + 1, prefix_length - 1);
 //length
 		if (length > 127)
 		{
-			prefix_length = 5;
-			prefix[3] = (0x007F & length) << 1;
-			prefix[4] = (0x7F80 & length) >> 7;
+			prefix_length++;
+			prefix[2] = (0x007F & length) << 1;
+			prefix[3] = (0x7F80 & length) >> 7;
 		}
 		else
-			prefix[3] = 1 | (length << 1);
-		postfix[0] = frame_calc_crc(prefix + 1, prefix_length - 1);
-		c = write(serial.fd, prefix, prefix_length);
-		if (c != prefix_length)
-		{
-			LOG(LOG_WARNING, "Couldn't write the whole prefix to the serial port for the virtual port %d. Wrote only %d bytes",
-				channel, c);
-			return 0;
-		}
+			prefix[2] = 1 | (length << 1);
+		*p++ = GSM0710_FRAME_FLAG;
+		memcpy(p, prefix, prefix_length);
+		p += prefix_length;
 		if (length > 0)
-		{
-			c = write(serial.fd, input, length);
-			if (length != c)
-			{
-				LOG(LOG_WARNING, "Couldn't write all data to the serial port from the virtual port %d. Wrote only %d bytes",
-					channel, c);
-				return 0;
-			}
-		}
-		c = write(serial.fd, postfix, 2);
-		if (c != 2)
-		{
-			LOG(LOG_WARNING, "Couldn't write the whole postfix to the serial port for the virtual port %d. Wrote only %d bytes",
-				channel, c);
-			return 0;
-		}
+			memcpy(p, input, length);
+		p += length;
+		*p++ = frame_fcs(prefix, prefix_length, input, length);
+		*p++ = GSM0710_FRAME_FLAG;
 	}
 	else//cmux_mode
 	{
-		int offs = 1;
-		serial.adv_frame_buf[0] = GSM0710_FRAME_ADV_FLAG;
-		offs += fill_adv_frame_buf(serial.adv_frame_buf + offs, prefix + 1, 2);// address, control
-		offs += fill_adv_frame_buf(serial.adv_frame_buf + offs, input, length);// data
+		p += fill_adv_frame_buf(p, prefix, 2);// address, control
+		p += fill_adv_frame_buf(p, input, length);// data
 //CRC checksum
-		postfix[0] = frame_calc_crc(prefix + 1, 2);
-		offs += fill_adv_frame_buf(serial.adv_frame_buf + offs, postfix, 1);// fcs
-		serial.adv_frame_buf[offs] = GSM0710_FRAME_ADV_FLAG;
-		offs++;
-		syslogdump(">s ", (unsigned char *)serial.adv_frame_buf, offs);
-		c = write(serial.fd, serial.adv_frame_buf, offs);
-		if (c != offs)
-		{
-			LOG(LOG_WARNING, "Couldn't write the whole advanced option packet to the serial port for the virtual port %d. Wrote only %d bytes",
-				channel, c);
-			return 0;
-		}
+		fcs = frame_fcs(prefix, 2, input, length);
+		p += fill_adv_frame_buf(p, &fcs, 1);// fcs
+		*p++ = GSM0710_FRAME_ADV_FLAG;
 	}
-	LOG(LOG_DEBUG, "Leave");
+	queue->length = p - queue->data;
+	queue->frame_end[queue->frame_count++] = queue->length;
 	return length;
 }
 
-/*
- * Handles received data from device. PARAMS: buf - buffer, which
- * contains received data len - the length of the buffer channel - the
- * number of devices (logical channel), where data was received
- * RETURNS: the number of remaining bytes in partial packet
+/**
+ * Tells how many bytes there are in a ring, for either side.
  */
-static int handle_channel_data(
-	unsigned char *buf,
-	int len,
-	int channel)
+static unsigned int ring_length(
+	GSM0710_Ring *ring)
 {
-	int written = 0;
-	int i = 0;
-	int last = 0;
-//try to write 5 times
-	while (written != len && i < GSM0710_WRITE_RETRIES)
-	{
-		last = write_frame(channel, buf + written, len - written, GSM0710_TYPE_UIH);
-		written += last;
-		if (last == 0)
-			i++;
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Appends as much of the data to a ring as fits, for the writer only.
+ *
+ * RETURNS:
+ * number of bytes appended
+ */
+static int ring_write(
+	GSM0710_Ring *ring,
+	const unsigned char *data,
+	int length)
+{
+	length = min(length, (int)(ring->size - ring_length(ring)));
+	memcpy(ring->data + (ring->head & (ring->size - 1)), data, length);
+//the reader sees the data before the head that covers it
+	__atomic_store_n(&ring->head, ring->head + length, __ATOMIC_RELEASE);
+	return length;
+}
+
+/**
+ * Wakes the other side of the serial I/O thread.
+ *
+ * PARAMS:
+ * fd - its eventfd
+ */
+static void serial_thread_wake(
+	int fd)
+{
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		LOG(LOG_WARNING, "Couldn't wake the serial I/O thread: '%s' (code: %d)", strerror(errno), errno);
+}
+
+/**
+ * Hands encoded frames to the serial I/O thread, as much as its ring
+ * takes. If that isn't all, the thread notifies the main loop when it
+ * made room.
+ *
+ * RETURNS:
+ * number of bytes taken
+ */
+static int serial_thread_send(
+	const unsigned char *data,
+	int length)
+{
+	int c = ring_write(&serial_thread.tx, data, length);
+	if (c < length)
+	{
+//ask first, then look again, so the thread can't miss the request
+		__atomic_store_n(&serial_thread.tx_waiting, 1, __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		c += ring_write(&serial_thread.tx, data + c, length - c);
+	}
+	if (c > 0)
+		serial_thread_wake(serial_thread.wake_fd);
+	return c;
+}
+
+static void channel_update_watch(Channel* channel);
+static void channel_update_watches();
+gboolean serial_device_write(GIOChannel *source, GIOCondition condition, gpointer data);
+static int i_frame_send(Channel* channel, const unsigned char *input, int length);
+static int i_frames_room(Channel* channel);
+static void i_frames_reset(Channel* channel);
+static void i_frame_left(Channel* channel);
+
+/**
+ * Takes the first frames off the list of the transmit queue, they went
+ * out or were dropped. T1 starts for the I frames among them.
+ *
+ * PARAMS:
+ * count - number of frames
+ */
+static void tx_frames_done(
+	int count)
+{
+	GSM0710_Queue *queue = &serial.tx_queue;
+	int f;
+	for (f = 0; f < count; f++)
+		if (queue->frame_i[f] >= 0)
+			i_frame_left(channellist + queue->frame_i[f]);
+	queue->frame_count -= count;
+	memmove(queue->frame_end, queue->frame_end + count, queue->frame_count * sizeof(int));
+	memmove(queue->frame_start, queue->frame_start + count, queue->frame_count * sizeof(int));
+	memmove(queue->frame_i, queue->frame_i + count, queue->frame_count);
+}
+
+/**
+ * Takes the I frames of a channel out of the transmit queue which didn't
+ * start to go out yet, for sending them again in order.
+ *
+ * PARAMS:
+ * channel - channel number
+ *
+ * RETURNS:
+ * number of frames taken out
+ */
+static int tx_queue_drop_i(
+	int channel)
+{
+	GSM0710_Queue *queue = &serial.tx_queue;
+	int f, n = 0, cut = 0, start, end;
+	for (f = 0; f < queue->frame_count; f++)
+	{
+		start = queue->frame_start[f] - cut;
+		end = queue->frame_end[f] - cut;
+		if (queue->frame_i[f] == channel && start >= queue->head)
+		{
+			if (serial.rpn_switch && start < queue->head + serial.rpn_old_bytes)
+				serial.rpn_old_bytes -= end - start;
+			memmove(queue->data + start, queue->data + end, queue->length - end);
+			queue->length -= end - start;
+			cut += end - start;
+			continue;
+		}
+		queue->frame_start[n] = start;
+		queue->frame_end[n] = end;
+		queue->frame_i[n++] = queue->frame_i[f];
+	}
+	f = queue->frame_count - n;
+	queue->frame_count = n;
+	return f;
+}
+
+/**
+ * Writes as much of the transmit queue to the serial port as it takes
+ * without blocking, a partial write is resumed where it stopped when the
+ * port becomes writable again. With the serial I/O thread the queue goes
+ * to its ring instead and is resumed when the thread made room. Called
+ * when a main loop iteration ends and when the queue is full.
+ *
+ * RETURNS:
+ * number of bytes still queued
+ */
+static int tx_flush()
+{
+	GSM0710_Queue *queue = &serial.tx_queue;
+	int written = 0;
+	int c, f, end;
+	if (queue->head == queue->length)
+		return 0;
+//while the port waits to switch speed only what was queued before the
+//RPN answer goes out
+	end = serial.rpn_switch ? queue->head + serial.rpn_old_bytes : queue->length;
+	while (queue->head < end)
+	{
+		if (serial_thread.running)
+		{
+			if ((c = serial_thread_send(queue->data + queue->head, end - queue->head)) == 0)
+			{
+				errno = EAGAIN;
+				c = -1;
+			}
+		}
+		else if (serial.fd < 0)
+		{
+			errno = EBADF;
+			c = -1;
+		}
+		else
+		{
+			c = write(serial.fd, queue->data + queue->head, end - queue->head);
+			serial.tx_syscalls++;
+		}
+		if (c < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (c < 0)
+		{
+			LOG(LOG_WARNING, "Couldn't write to the serial port, dropping %d frames: '%s' (code: %d)",
+				queue->frame_count, strerror(errno), errno);
+			tx_frames_done(queue->frame_count);
+			queue->head = queue->length;
+			break;
+		}
+		syslogdump(">s ", queue->data + queue->head, c);
+		queue->head += c;
+		written += c;
+	}
+	if (serial.rpn_switch)
+		serial.rpn_old_bytes = max(end - queue->head, 0);
+	if (written > 0)
+	{
+		link_touch(&serial);
+		serial.tx_bytes += written;
+		serial.tx_flushes++;
+	}
+	for (f = 0; f < queue->frame_count && queue->frame_end[f] <= queue->head; f++)
+		;
+	serial.tx_frames += f;
+	tx_frames_done(f);
+	if (queue->head < queue->length)
+	{
+		LOG(LOG_DEBUG, "Wrote %d frames, %d bytes wait for the serial port", f, queue->length - queue->head);
+		if (serial.g_source_out == (guint)-1 && serial.g_channel != NULL && !serial_thread.running
+			&& queue->head < end)
+			serial.g_source_out = mux_watch_add(serial.g_channel, G_IO_OUT, serial_device_write, &serial);
+		if (!serial.tx_blocked)
+		{
+//the serial port lags behind, leave the data in the ptys until the
+//queue is written
+			LOG(LOG_DEBUG, "Serial port busy, stop reading the ptys");
+			serial.tx_blocked = 1;
+			channel_update_watches();
+		}
+		return queue->length - queue->head;
+	}
+	LOG(LOG_DEBUG, "Wrote %d frames, %d bytes", f, written);
+	queue->head = 0;
+	queue->length = 0;
+	if (serial.g_source_out != (guint)-1)
+		mux_watch_remove(serial.g_source_out);
+	serial.g_source_out = -1;
+	if (serial.tx_blocked)
+	{
+		LOG(LOG_DEBUG, "Transmit queue written, reading the ptys again");
+		serial.tx_blocked = 0;
+		channel_update_watches();
+	}
+	return 0;
+}
+
+/**
+ * Waits until the transmit queue is written, for talking to the modem
+ * directly afterwards.
+ *
+ * PARAMS:
+ * timeout - milliseconds to wait at most
+ *
+ * RETURNS:
+ * number of bytes still queued
+ */
+static int tx_drain(
+	int timeout)
+{
+	struct pollfd pfd;
+	int queued;
+	while ((queued = tx_flush()) > 0)
+	{
+		pfd.fd = serial.fd;
+		pfd.events = POLLOUT;
+		if (poll(&pfd, 1, timeout) <= 0)
+		{
+			LOG(LOG_WARNING, "Serial port not writable, %d bytes stay queued", queued);
+			break;
+		}
+	}
+	return queued;
+}
+
+/**
+ * Empties the transmit queue, what it held is dropped.
+ */
+static void tx_queue_reset(
+	Serial* serial)
+{
+	serial->tx_queue.head = 0;
+	serial->tx_queue.length = 0;
+	serial->tx_queue.frame_count = 0;
+	serial->rpn_old_bytes = 0;
+}
+
+/**
+ * Tells how much channel data surely fits into the transmit queue. The
+ * last GSM0710_QUEUE_RESERVE frames are left to the control channel.
+ *
+ * PARAMS:
+ * N1 - the frame size the data is sent in
+ */
+static int tx_room(
+	int N1)
+{
+	GSM0710_Queue *queue = &serial.tx_queue;
+	int frames = min(GSM0710_QUEUE_FRAMES - queue->frame_count,
+		(queue->size - queue->length + queue->head) / GSM0710_ADV_FRAME_SIZE(N1));
+	return max(frames - GSM0710_QUEUE_RESERVE, 0) * N1;
+}
+
+/**
+ * Queues a frame to a logical channel, it is sent when the main loop
+ * iteration ends. C/R bit is set to 1, but for RR, RNR and REJ.
+ *
+ * PARAMS:
+ * channel - channel number (0 = control)
+ * input - the data to be written
+ * length - the length of the data
+ * type - the type of the frame (with possible P/F-bit)
+ *
+ * RETURNS:
+ * number of characters queued
+ */
+static int write_frame(
+	int channel,
+	const unsigned char *input,
+	int length,
+	unsigned char type)
+{
+	int queued;
+	LOG(LOG_DEBUG, "Enter");
+	LOG(LOG_DEBUG, "Sending frame to channel %d", channel);
+	if ((queued = tx_queue_frame(channel, input, length, type)) < 0)
+	{
+//queue is full, make room if the port takes some
+		tx_flush();
+		queued = tx_queue_frame(channel, input, length, type);
+	}
+	if (queued < 0)
+	{
+		LOG(LOG_WARNING, "Transmit queue full, dropping the frame for the virtual port %d", channel);
+		return 0;
 	}
-	if (i == GSM0710_WRITE_RETRIES)
+	LOG(LOG_DEBUG, "Leave");
+	return queued;
+}
+
+/*
+ * Handles received data from device. PARAMS: buf - buffer, which
+ * contains received data len - the length of the buffer channel - the
+ * number of devices (logical channel), where data was received
+ * RETURNS: the number of remaining bytes in partial packet
+ */
+static int handle_channel_data(
+	unsigned char *buf,
+	int len,
+	int channel)
+{
+	int written = 0;
+	int last;
+//queue it in N1 sized frames, they go out with the other channels' ones
+	while (written < len
+	&& (last = channellist[channel].i_frames != NULL
+		? i_frame_send(channellist + channel, buf + written, len - written)
+		: write_frame(channel, buf + written, len - written, GSM0710_TYPE_UIH)) > 0)
+		written += last;
+	serial.tx_payload += written;
+	if (written < len)
 		LOG(LOG_WARNING, "Couldn't write data to channel %d. Wrote only %d bytes, when should have written %d",
 				channel, written, len);
 	return 0;
 }
 
-static int logical_channel_close(Channel* channel)
+static GPollFunc glib_poll;
+static struct timespec poll_left;// when the last poll returned
+
+/**
+ * Polls for the main loop, keeps track of the longest time the loop
+ * spent between two polls, it can't react to anything meanwhile.
+ */
+static gint mux_poll(
+	GPollFD *ufds,
+	guint nfsd,
+	gint timeout)
 {
-	guint timeout_id;
-	GSource *timeout_source;
-	int write_retries;
+	struct timespec now;
+	long busy;
+	gint ret;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (poll_left.tv_sec != 0)
+	{
+		busy = (now.tv_sec - poll_left.tv_sec) * 1000000
+			+ (now.tv_nsec - poll_left.tv_nsec) / 1000;
+		if (busy > serial.loop_busy_max)
+		{
+			serial.loop_busy_max = busy;
+			LOG(LOG_DEBUG, "Main loop busy for %ld us", busy);
+		}
+	}
+	ret = glib_poll(ufds, nfsd, timeout);
+	clock_gettime(CLOCK_MONOTONIC, &poll_left);
+	if (timeout != 0)
+		serial.loop_wakeups++;
+	return ret;
+}
+
+/**
+ * Hooks into the GLib main loop, with -e the epoll set goes into it as
+ * a single fd.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+static int mux_loop_init()
+{
+	if (glib_poll == NULL)
+	{
+		glib_poll = g_main_context_get_poll_func(NULL);
+		g_main_context_set_poll_func(NULL, mux_poll);
+	}
+	if (use_epoll && epoll_fd < 0)
+	{
+		SYSCHECK(epoll_fd = epoll_create1(EPOLL_CLOEXEC));
+		SYSCHECK(watchdog_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+		watchdog_channel = g_io_channel_unix_new(watchdog_fd);
+		g_io_add_watch(g_io_channel_unix_new(epoll_fd), G_IO_IN, epoll_dispatch, NULL);
+		LOG(LOG_INFO, "Serial port and ptys are watched with epoll");
+	}
+	return 0;
+}
+
+static void watchdog_schedule(Serial* serial);
+
+/**
+ * Runs one iteration of the main loop and sends the frames queued
+ * during it. Nested loops waiting for an answer of the modem have to
+ * use it as well.
+ */
+static void mux_iteration(
+	gboolean may_block)
+{
+//whatever was queued outside the loop goes first
+	tx_flush();
+	g_main_context_iteration(NULL, may_block);
+	tx_flush();
+	watchdog_schedule(&serial);
+}
+
+static void channel_throttle(Channel* channel, int on);
+static void alloc_channel_reply(DBusGMethodInvocation* context, const char* channel, const char* error);
+
+/**
+ * Answers the AllocChannel call waiting for a channel, if there is one.
+ *
+ * PARAMS:
+ * channel - the channel
+ * error - why it couldn't be opened, NULL if it is open
+ */
+static void channel_alloc_reply(
+	Channel* channel,
+	const char* error)
+{
+	if (channel->alloc_context == NULL)
+		return;
+	if (channel->g_source_alloc != (guint)-1)
+		g_source_remove(channel->g_source_alloc);
+	channel->g_source_alloc = -1;
+	if (error == NULL)
+		LOG(LOG_INFO, "Logical channel %d for %s ready on %s", channel->id, channel->origin, channel->ptsname);
+	else
+		LOG(LOG_INFO, "Logical channel %d for %s failed: %s", channel->id, channel->origin, error);
+	alloc_channel_reply(channel->alloc_context, error ? NULL : channel->ptsname, error);
+	channel->alloc_context = NULL;
+}
+
+/**
+ * Sends what closes a channel towards the modem.
+ */
+static void channel_close_send(
+	Channel* channel)
+{
+	if (cmux_mode)
+		write_frame(channel->id, NULL, 0, GSM0710_TYPE_DISC | GSM0710_PF);
+	else
+		write_frame(channel->id, close_channel_cmd, 2, GSM0710_TYPE_UIH);
+}
+
+/**
+ * Ends the close handshake of a channel, it may be allocated again.
+ */
+static void channel_close_done(
+	Channel* channel)
+{
+	if (channel->g_source_close != (guint)-1)
+		g_source_remove(channel->g_source_close);
+	channel->g_source_close = -1;
+	channel->closing = 0;
+	channel->opened = 0;
+	channel->origin[0] = '\0';
+}
 
+/**
+ * Sends the DISC of a closing channel again while there is no UA, gives
+ * up after GSM0710_WRITE_RETRIES.
+ */
+static gboolean channel_close_timeout(
+	gpointer data)
+{
+	Channel* channel = (Channel*)data;
 	LOG(LOG_DEBUG, "Enter");
+	if (channel->opened && ++channel->close_retries < GSM0710_WRITE_RETRIES)
+	{
+		LOG(LOG_DEBUG, "No UA for channel %d yet, sending DISC again", channel->id);
+		channel_close_send(channel);
+		return TRUE;
+	}
 	if (channel->opened)
+		LOG(LOG_WARNING, "Unable to properly close a channel");
+//the timer ends with this call
+	channel->g_source_close = -1;
+	channel_close_done(channel);
+	return FALSE;
+}
+
+/**
+ * Closes a channel. The pty and everything else on our side is released
+ * right away, if the channel is open towards the modem the DISC/UA
+ * handshake finishes in the background and the channel can't be
+ * allocated again until then.
+ *
+ * RETURNS:
+ * 0
+ */
+static int logical_channel_close(Channel* channel)
+{
+	LOG(LOG_DEBUG, "Enter");
+	channel_alloc_reply(channel, "Channel closed");
+	if (channel->opened && !channel->closing)
 	{
 		LOG(LOG_INFO, "Logical channel %d for %s closing", channel->id, channel->origin);
-		for (write_retries=0; write_retries<GSM0710_WRITE_RETRIES; write_retries++)
-		{
-			if (cmux_mode)
-				write_frame(channel->id, NULL, 0, GSM0710_TYPE_DISC | GSM0710_PF);
-			else
-				write_frame(channel->id, close_channel_cmd, 2, GSM0710_TYPE_UIH);
-			timeout_id = g_timeout_add_seconds(3, glib_returnfalse, NULL);
-			timeout_source = g_main_context_find_source_by_id(NULL, timeout_id);
-			do
-			{
-				LOG(LOG_DEBUG, "g_main_context_iteration");
-				g_main_context_iteration(NULL, TRUE);
-			}
-			while (channel->opened && !g_source_is_destroyed(timeout_source));
-			if (!channel->opened)
-				break;
-		} 
-		/* No need to explicitly destroy this source */
-		if (channel->opened)
-			LOG(LOG_WARNING, "Unable to properly close a channel");
+		channel->closing = 1;
+		channel->close_retries = 0;
+		channel_close_send(channel);
+		channel->g_source_close = g_timeout_add_seconds(3, channel_close_timeout, channel);
 	}
+	else if (!channel->opened)
+		channel_close_done(channel);
 
-	if (channel->g_source >= 0)
-		g_source_remove(channel->g_source);
+//account the time throttled
+	if (channel->throttled)
+		channel_throttle(channel, 0);
+	if (channel->g_source != (guint)-1)
+		mux_watch_remove(channel->g_source);
 	channel->g_source = -1;
+	if (channel->g_source_out != (guint)-1)
+		mux_watch_remove(channel->g_source_out);
+	channel->g_source_out = -1;
+	if (channel->out_length > 0)
+		LOG(LOG_WARNING, "Logical channel %d closed with %d bytes not taken by the pty reader",
+			channel->id, channel->out_length);
+	if (channel->g_channel != NULL)
+		g_io_channel_unref(channel->g_channel);
+	channel->g_channel = NULL;
 	if (channel->fd >= 0)
 		close(channel->fd);
 	channel->fd = -1;
-	if (channel->ptsname != NULL)
-		free(channel->ptsname);
-	channel->ptsname = NULL;
-	if (channel->tmp != NULL)
-		free(channel->tmp);
-	channel->tmp = NULL;
-	if (channel->origin != NULL)
-		free(channel->origin);
-	channel->origin = NULL;
-	channel->opened = 0;
+	channel->ptsname[0] = '\0';
+	if (channel->throttle_count > 0)
+		LOG(LOG_INFO, "Logical channel %d was throttled %lu times for %lu ms",
+			channel->id, channel->throttle_count, channel->throttled_ms);
 	channel->frames_allowed = 0;
+	channel->throttled = 0;
+	channel->throttled_ms = 0;
+	channel->throttle_count = 0;
+	if (channel->out_fc_count > 0)
+		LOG(LOG_INFO, "Logical channel %d held back the modem %lu times", channel->id, channel->out_fc_count);
+	channel->out_head = 0;
+	channel->out_length = 0;
+	channel->out_fc = 0;
+	channel->out_fc_count = 0;
 	channel->v24_signals = 0;
 	channel->remaining = 0;
+	channel->N1 = cmux_N1;
+	channel->k = GSM0710_BULK_K;
+	i_frames_reset(channel);
 	return 0;
 }
 
@@ -590,9 +1947,16 @@ static int logical_channel_init(Channel* channel, int id)
 	channel->devicename = id?"/dev/ptmx":NULL; // TODO do we need this to be dynamic anymore?
 	channel->fd = -1;
 	channel->g_source = -1;
-	channel->ptsname = NULL;
-	channel->tmp = NULL;
-	channel->origin = NULL;
+	channel->g_source_out = -1;
+	channel->g_source_alloc = -1;
+	channel->alloc_context = NULL;
+	channel->g_source_close = -1;
+	channel->closing = 0;
+	channel->tmp = arena_alloc(&serial.arena, cmux_N1);
+	channel->out_size = GSM0710_PTY_QUEUE_SIZE(cmux_N1);
+	channel->out = arena_alloc(&serial.arena, channel->out_size);
+	channel->i_frames = serial.arena_k > 0 ? arena_alloc(&serial.arena, serial.arena_k * cmux_N1) : NULL;
+	channel->g_source_t1 = -1;
 	channel->opened = 0;
 	return logical_channel_close(channel);
 }
@@ -604,37 +1968,63 @@ gboolean pseudo_device_read(GIOChannel *source, GIOCondition condition, gpointer
 	if (condition == G_IO_IN)
 	{
 		unsigned char buf[4096];
-		//information from virtual port
-		int len = read(channel->fd, buf + channel->remaining, sizeof(buf) - channel->remaining);
-		if (!channel->opened)
+		int room, window, wanted, got, len;
+//read until the pty is drained, the epoll backend only tells of new data
+		do
 		{
-			LOG(LOG_WARNING, "Write to a channel which wasn't acked to be open.");
-			write_frame(channel->id, NULL, 0, GSM0710_TYPE_SABM | GSM0710_PF);
-			LOG(LOG_DEBUG, "Leave");
-			return TRUE;
-		}
-		if (len >= 0)
-		{
-			LOG(LOG_DEBUG, "Data from channel %d, %d bytes", channel->id, len);
-			if (channel->remaining > 0)
+			if ((room = tx_room(channel->N1)) == 0)
 			{
-				memcpy(buf, channel->tmp, channel->remaining);
-				free(channel->tmp);
-				channel->tmp = NULL;
+//the queue is written when the iteration ends, read on afterwards
+				LOG(LOG_DEBUG, "Transmit queue full");
+				mux_watch_rearm(channel->g_source);
+				return TRUE;
+			}
+			if ((window = i_frames_room(channel)) == 0)
+			{
+//an acknowledgement of the modem opens it again
+				LOG(LOG_DEBUG, "Window of channel %d closed", channel->id);
+				channel_update_watch(channel);
+				return FALSE;
 			}
-			if (len + channel->remaining > 0)
-				channel->remaining = handle_channel_data(buf, len + channel->remaining, channel->id);
-			//copy remaining bytes from last packet into tmp
+			if (window > 0)
+				room = min(room, window);
+			//information from virtual port
+			wanted = min(sizeof(buf) - channel->remaining, room);
+			got = read(channel->fd, buf + channel->remaining, wanted);
+			if (!channel->opened)
+			{
+				LOG(LOG_WARNING, "Write to a channel which wasn't acked to be open.");
+				write_frame(channel->id, NULL, 0, GSM0710_TYPE_SABM | GSM0710_PF);
+				LOG(LOG_DEBUG, "Leave");
+				return TRUE;
+			}
+			if (got < 0 && errno == EAGAIN)
+				break;
+			if (got < 0)
+			{
+				// dropped connection
+				logical_channel_close(channel);
+				LOG(LOG_DEBUG, "Leave");
+				return FALSE;
+			}
+			ALLOC_CHECK_ENTER();
+			LOG(LOG_DEBUG, "Data from channel %d, %d bytes", channel->id, got);
+			len = got + channel->remaining;
+			if (channel->remaining > 0)
+				memcpy(buf, channel->tmp, channel->remaining);
+			if (len > 0)
+				channel->remaining = handle_channel_data(buf, len, channel->id);
+			//copy remaining bytes (a partial frame) from last packet into tmp
 			if (channel->remaining > 0)
 			{
-				channel->tmp = malloc(channel->remaining);
-				memcpy(channel->tmp, buf + sizeof(buf) - channel->remaining, channel->remaining);
+				channel->remaining = min(channel->remaining, channel->N1);
+				memcpy(channel->tmp, buf + len - channel->remaining, channel->remaining);
 			}
-			LOG(LOG_DEBUG, "Leave");
-			return TRUE;
+			ALLOC_CHECK_LEAVE();
 		}
-		// dropped connection
-		logical_channel_close(channel);
+		while (got == wanted && channel->g_source != (guint)-1);
+		LOG(LOG_DEBUG, "Leave");
+		return TRUE;
 	}
 	else if (condition == G_IO_HUP)
 	{
@@ -644,706 +2034,1644 @@ gboolean pseudo_device_read(GIOChannel *source, GIOCondition condition, gpointer
 	return FALSE;
 }
 
-static gboolean watchdog(gpointer data);
-static int close_devices();
-
-static gboolean c_get_power(const char* origin)
+/**
+ * Reads the pty of a channel only while the modem lets it send and the
+ * transmit queue has room.
+ */
+static void channel_update_watch(
+	Channel* channel)
 {
-	LOG(LOG_DEBUG, "Enter");
-	LOG(LOG_DEBUG, "Leave");
-	return serial.state != MUX_STATE_OFF;
+	int reading = channel->fd >= 0 && !channel->throttled && !serial.tx_blocked
+		&& i_frames_room(channel) != 0;
+	if (reading && channel->g_source == (guint)-1)
+		channel->g_source = mux_watch_add(channel->g_channel, G_IO_IN | G_IO_HUP, pseudo_device_read, channel);
+	else if (!reading && channel->g_source != (guint)-1)
+	{
+		mux_watch_remove(channel->g_source);
+		channel->g_source = -1;
+	}
 }
 
-static gboolean c_set_power(const char* origin, gboolean on)
+static void channel_update_watches()
 {
-	LOG(LOG_DEBUG, "Enter");
+	int i;
+	for (i = 1; i < GSM0710_MAX_CHANNELS; i++)
+		channel_update_watch(channellist + i);
+}
+
+/**
+ * Stops or resumes reading the pty of a channel as the modem asks for
+ * with the FC bit of MSC. The other channels keep flowing.
+ *
+ * PARAMS:
+ * channel - the channel
+ * on - 1 to stop reading, 0 to resume
+ */
+static void channel_throttle(
+	Channel* channel,
+	int on)
+{
+	struct timespec now;
+	if (channel->throttled == on || channel->fd < 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
 	if (on)
 	{
-		if (serial.state == MUX_STATE_OFF)
-		{
-			LOG(LOG_INFO, "power on");
-			serial.state = MUX_STATE_OPENING;
-			watchdog(&serial);
-		}
-		else
-			LOG(LOG_WARNING, "power on request received but was already on");
+		LOG(LOG_DEBUG, "Logical channel %d throttled", channel->id);
+		channel->throttled_since = now;
+		channel->throttle_count++;
 	}
 	else
 	{
-		if (serial.state == MUX_STATE_MUXING)
-		{
-			LOG(LOG_INFO, "power off");
-			g_source_remove(serial.g_source_watchdog);
-			close_devices();
-		}
-		else
-			LOG(LOG_WARNING, "power off received but wasn't on/muxing");
+		LOG(LOG_DEBUG, "Logical channel %d resumed", channel->id);
+		channel->throttled_ms += (now.tv_sec - channel->throttled_since.tv_sec) * 1000
+			+ (now.tv_nsec - channel->throttled_since.tv_nsec) / 1000000;
 	}
-	LOG(LOG_DEBUG, "Leave");
-	return TRUE;
+	channel->throttled = on;
+	channel_update_watch(channel);
 }
 
-static gboolean c_reset_modem(const char* origin)
+/**
+ * Tells the modem to hold back or resume sending on a channel with the
+ * FC bit of MSC.
+ *
+ * PARAMS:
+ * channel - the channel
+ * on - 1 to assert FC, 0 to clear it
+ */
+static void channel_flow_control(
+	Channel* channel,
+	int on)
 {
-	LOG(LOG_DEBUG, "Enter");
-	LOG(LOG_INFO, "modem reset");
-	serial.state = MUX_STATE_CLOSING;				
-	return TRUE;
+	unsigned char msc[] = {
+		GSM0710_CONTROL_MSC | GSM0710_CR,
+		GSM0710_EA | (2 << 1),
+		GSM0710_EA | GSM0710_CR | (channel->id << 2),
+		channel->v24_signals | (on ? GSM0710_SIGNAL_FC : 0),
+	};
+	LOG(LOG_DEBUG, "Logical channel %d %s FC with %d bytes queued",
+		channel->id, on ? "asserts" : "clears", channel->out_length);
+	write_frame(0, msc, sizeof(msc), GSM0710_TYPE_UIH);
+	channel->out_fc = on;
+	if (on)
+		channel->out_fc_count++;
 }
 
-static gboolean c_alloc_channel(const char* origin, const char** name)
+/**
+ * Tells how much data the window of a channel still takes in the error
+ * recovery mode.
+ *
+ * RETURNS:
+ * bytes, -1 without the error recovery mode
+ */
+static int i_frames_room(
+	Channel* channel)
 {
-	LOG(LOG_DEBUG, "Enter");
-	int i;
-	guint timeout_id;
-	GSource *timeout_source;
-	int write_retries;
-	if (serial.state == MUX_STATE_MUXING)
-		for (i=1;i<GSM0710_MAX_CHANNELS;i++)
-			if (channellist[i].fd < 0) // is this channel free?
-			{
-				LOG(LOG_DEBUG, "Found channel %d fd %d on %s", i, channellist[i].fd, channellist[i].devicename);
-				channellist[i].origin = strdup(origin);
-				SYSCHECK(channellist[i].fd = open(channellist[i].devicename, O_RDWR | O_NONBLOCK)); //open devices
-				char* pts = ptsname(channellist[i].fd);
-				if (pts == NULL) SYSCHECK(-1);
-				channellist[i].ptsname = strdup(pts);
-				struct termios options;
-				tcgetattr(channellist[i].fd, &options); //get the parameters
-				options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG); //set raw input
-				options.c_iflag &= ~(INLCR | ICRNL | IGNCR);
-				options.c_oflag &= ~(OPOST| OLCUC| ONLRET| ONOCR| OCRNL); //set raw output
-				tcsetattr(channellist[i].fd, TCSANOW, &options);
-				if (!strcmp(channellist[i].devicename, "/dev/ptmx"))
-				{
-					//Otherwise programs cannot access the pseudo terminals
-					SYSCHECK(grantpt(channellist[i].fd));
-					SYSCHECK(unlockpt(channellist[i].fd));
-				}
-				channellist[i].v24_signals = GSM0710_SIGNAL_DV | GSM0710_SIGNAL_RTR | GSM0710_SIGNAL_RTC | GSM0710_EA;
-				channellist[i].g_channel = g_io_channel_unix_new(channellist[i].fd);
-				g_io_channel_set_encoding(channellist[i].g_channel, NULL, NULL );
-				g_io_channel_set_buffer_size( channellist[i].g_channel, PTY_GLIB_BUFFER_SIZE );
-				channellist[i].g_source = g_io_add_watch(channellist[i].g_channel, G_IO_IN | G_IO_HUP, pseudo_device_read, channellist+i);
-				LOG(LOG_INFO, "Connecting %s to virtual channel %d for %s on %s",
-					channellist[i].ptsname, channellist[i].id, channellist[i].origin, serial.devicename);
-				*name = strdup(channellist[i].ptsname);
-				for (write_retries=0; write_retries<GSM0710_WRITE_RETRIES; write_retries++)
-				{
-					write_frame(i, NULL, 0, GSM0710_TYPE_SABM | GSM0710_PF);
-					timeout_id = g_timeout_add_seconds(3, glib_returnfalse, NULL);
-					timeout_source = g_main_context_find_source_by_id(NULL, timeout_id);
-					do
-					{
-						LOG(LOG_DEBUG, "g_main_context_iteration");
-						g_main_context_iteration(NULL, TRUE);
-					}
-					while (!channellist[i].frames_allowed && !g_source_is_destroyed(timeout_source));
-					if (channellist[i].opened)
-						break;
-				} 
-				/* No need to explicitly destroy this source */
-				if (!channellist[i].frames_allowed)
-				{
-					LOG(LOG_INFO, "Unable to open the new channel %d", i);
-					logical_channel_close(&channellist[i]);
-					return FALSE;
-				}
-				return TRUE;
-			}
-	LOG(LOG_WARNING, "not muxing or no free channel found");
-	return TRUE;
+	int window;
+	if (channel->i_frames == NULL || channel->id == 0)
+		return -1;
+	if (channel->peer_busy)
+		return 0;
+	window = min(max(channel->k, 1), serial.arena_k);
+	return max(window - ((channel->vs - channel->va) & 7), 0) * channel->N1;
 }
 
-static void my_log_handler(
-	const gchar *log_domain,
-	GLogLevelFlags log_level,
-	const gchar *message,
-	gpointer user_data)
+/**
+ * Sends the I frames not acknowledged yet again, go back N. Those still
+ * in the transmit queue are taken out first, so each goes once and in
+ * order.
+ */
+static void i_frames_resend(
+	Channel* channel)
 {
-	LOG(LOG_INFO, "%d %s %s", log_level, log_domain, message);
+	int n, slot, count;
+	channel->i_unsent = max(channel->i_unsent - tx_queue_drop_i(channel->id), 0);
+	count = (channel->vs - channel->va) & 7;
+	for (n = 0; n < count; n++)
+	{
+		slot = (channel->i_first + n) % serial.arena_k;
+		if (write_frame(channel->id, channel->i_frames + slot * cmux_N1, channel->i_length[slot],
+			GSM0710_TYPE_I | GSM0710_NS((channel->va + n) & 7) | GSM0710_NR(channel->vr)) > 0)
+			channel->i_unsent++;
+	}
+	channel->i_resent += count;
+	channel->ack_pending = 0;
 }
 
-#include "muxercontrol.c"
-#include "mux-glue.h"
-
-static int dbus_init()
+/**
+ * T1 ran out before the modem acknowledged the I frames sent, they are
+ * sent again up to N2 times before the channel is given up.
+ */
+static gboolean i_frames_timeout(
+	gpointer data)
 {
-	g_log_set_handler(NULL, G_LOG_LEVEL_MASK, my_log_handler, NULL);
-	g_type_init();
-	g_log_set_always_fatal(G_LOG_LEVEL_WARNING);
-	GError* g_err = NULL;
-	g_conn = dbus_g_bus_get(DBUS_BUS_SYSTEM, &g_err);
-	if (g_err != NULL)
+	Channel* channel = (Channel*)data;
+	if (channel->va == channel->vs)
 	{
-		//g_printerr
-		LOG(LOG_ERR, "Connecting to system bus failed: %s", g_err->message);
-		g_error_free(g_err);
-		return -1;
+		channel->g_source_t1 = -1;
+		return FALSE;
 	}
-	GObject* obj = (GObject*)muxer_control_gen();
-	DBusError err;
-	memset(&err, 0, sizeof(err));
-	if (dbus_bus_request_name(dbus_g_connection_get_connection(g_conn), "org.pyneo.muxer", DBUS_NAME_FLAG_ALLOW_REPLACEMENT|DBUS_NAME_FLAG_REPLACE_EXISTING, &err) < 0)
+	if (++channel->t1_expiries > cmux_N2)
 	{
-		if (dbus_error_is_set(&err))
-			LOG(LOG_ERR, "dbus error with dbus_bus_request_name '%s' '%s'", err.name, err.message);
-		else
-			LOG(LOG_ERR, "dbus error with dbus_bus_request_name");
-		return -1;
+		LOG(LOG_WARNING, "No acknowledgement on channel %d after %d retransmissions, closing it",
+			channel->id, cmux_N2);
+//the timer ends with this call
+		channel->g_source_t1 = -1;
+		logical_channel_close(channel);
+		return FALSE;
 	}
-	dbus_g_object_type_install_info(TYPE_MUXER_CONTROL, &dbus_glib_mux_object_info);
-	dbus_g_connection_register_g_object(g_conn, object_name, obj);
-	return 0;
+	LOG(LOG_INFO, "T1 ran out on channel %d, sending %d I frames again",
+		channel->id, (channel->vs - channel->va) & 7);
+//T1 starts again when they leave the transmit queue
+	channel->g_source_t1 = -1;
+	i_frames_resend(channel);
+	return FALSE;
 }
 
-static int dbus_deinit()
+/**
+ * Starts T1 over for the I frames not acknowledged yet, stops it if
+ * none of them left the transmit queue. T1 counts from when the frame
+ * left, plus the time the frame takes on the link.
+ */
+static void i_frames_timer(
+	Channel* channel)
 {
-	if (g_conn)
-		dbus_g_connection_unref(g_conn);
-	return 0;
+	int t1 = cmux_T1 * 10;
+	if (channel->g_source_t1 != (guint)-1)
+		g_source_remove(channel->g_source_t1);
+	channel->g_source_t1 = -1;
+	if (((channel->vs - channel->va) & 7) <= channel->i_unsent)
+		return;
+	if (serial.speed > 0)
+		t1 += GSM0710_ADV_FRAME_SIZE(channel->N1) * 10 * 1000 / serial.speed;
+	channel->g_source_t1 = g_timeout_add(t1, i_frames_timeout, channel);
 }
 
-static int dbus_signal_send_deactivate(const char* sigvalue)
+/**
+ * An I frame of the channel left the transmit queue, T1 runs from now
+ * on if it doesn't already.
+ */
+static void i_frame_left(
+	Channel* channel)
 {
-	DBusConnection* conn = dbus_g_connection_get_connection(g_conn);
-	if (NULL == conn)
-	{
-		LOG(LOG_ERR, "Connection null"); 
-		return -1;
-	}
-	DBusMessage* msg = dbus_message_new_signal(object_name, // object name of the signal
-		"org.freesmartphone.GSM.MUX", // interface name of the signal
-		"deactivate"); // name of the signal
-	if (NULL == msg) 
-	{ 
-		LOG(LOG_ERR, "Message Null"); 
-		return -1;
-	}
-	DBusMessageIter args;
-	dbus_message_iter_init_append(msg, &args); // append arguments onto signal
-	if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &sigvalue))
-	{ 
-		LOG(LOG_ERR, "Out Of Memory"); 
-		return -1;
-	}
-	dbus_uint32_t g_serial = 0; // unique number to associate replies with requests
-	if (!dbus_connection_send(conn, msg, &g_serial)) // send the message and flush the connection
-	{ 
-		LOG(LOG_ERR, "Out Of Memory"); 
-		return -1;
-	}
-	dbus_connection_flush(conn);
-	// free the message 
-	dbus_message_unref(msg);
-	return 0;
+	if (channel->i_unsent > 0)
+		channel->i_unsent--;
+	if (channel->g_source_t1 == (guint)-1)
+		i_frames_timer(channel);
 }
 
 /**
-	GPtrArray *table = parse("(14-5),(3-7),(4-9),(33)");
-
-	for(int i = 0; i < table->len; i++)
-	{
-		int *arr = g_ptr_array_index(table, i);
-		printf("(%d, %d)\n", arr[0], arr[1]);
-	}
-*/
-GPtrArray* parse(const gchar* str)
+ * Forgets the I frames of a channel, they start at 0 again.
+ */
+static void i_frames_reset(
+	Channel* channel)
 {
-	GPtrArray *table = g_ptr_array_new();
-	int i = -1;
-	int first = -1;
-	int pos = 0;
-	while(str[++i] != 0)
-	{
-		if(str[i] == '(')
-		{
-			pos = i+1;
-			first = -1;
-		}
-		else if(str[i] == ')')
-		{
-			int *tuple = malloc(sizeof(int)*2);
-			
-			tuple[1] = atoi(str + pos);
-			tuple[0] = first == -1 ? tuple[1] : first;
-			
-			g_ptr_array_add(table, (gpointer)tuple);
-		}
-		else if(str[i] == '-')
-		{
-			first = atoi(str + pos);
-			pos = i+1;
-		}
-	}
-	return table;
+	if (channel->i_resent > 0)
+		LOG(LOG_INFO, "Logical channel %d sent %lu I frames again", channel->id, channel->i_resent);
+	channel->vs = channel->va = channel->vr = 0;
+	channel->i_first = 0;
+	channel->ack_pending = 0;
+	channel->rej_sent = 0;
+	channel->peer_busy = 0;
+	channel->t1_expiries = 0;
+	channel->i_unsent = 0;
+	channel->in_batch = 0;
+	channel->local_busy = 0;
+	channel->busy_dropped = 0;
+	channel->i_resent = 0;
+	i_frames_timer(channel);
 }
 
-//////////////////////////////////////////////// real functions
-/* Allocates memory for a new buffer and initializes it.
+/**
+ * Sends data as an I frame, kept until the modem acknowledges it.
+ *
+ * PARAMS:
+ * channel - the channel
+ * input - the data
+ * length - its length, up to the channel's N1 of it are sent
  *
  * RETURNS:
- * the pointer to a new buufer
+ * number of bytes queued, 0 if the window or the queue is full
  */
-static GSM0710_Buffer *gsm0710_buffer_init(
-	)
+static int i_frame_send(
+	Channel* channel,
+	const unsigned char *input,
+	int length)
 {
-	GSM0710_Buffer* buf = (GSM0710_Buffer*)malloc(sizeof(GSM0710_Buffer));
-	if (buf)
-	{
-		memset(buf, 0, sizeof(GSM0710_Buffer));
-		buf->readp = buf->data;
-		buf->writep = buf->data;
-		buf->endp = buf->data + GSM0710_BUFFER_SIZE;
-	}
-	return buf;
+	int queued, slot;
+	if (i_frames_room(channel) == 0)
+		return 0;
+	length = min(length, channel->N1);
+	slot = (channel->i_first + ((channel->vs - channel->va) & 7)) % serial.arena_k;
+	if ((queued = write_frame(channel->id, input, length,
+		GSM0710_TYPE_I | GSM0710_NS(channel->vs) | GSM0710_NR(channel->vr))) <= 0)
+		return 0;
+	memcpy(channel->i_frames + slot * cmux_N1, input, queued);
+	channel->i_length[slot] = queued;
+	channel->vs = (channel->vs + 1) & 7;
+	channel->i_unsent++;
+//N(R) acknowledged what was received
+	channel->ack_pending = 0;
+	return queued;
 }
 
-/* Destroys the buffer (i.e. frees up the memory
- *
- * PARAMS:
- * buf - buffer to be destroyed
+/**
+ * Takes the acknowledgement of the I frames up to N(R), excluded.
  */
-static void gsm0710_buffer_destroy(
-	GSM0710_Buffer* buf)
+static void i_frames_acked(
+	Channel* channel,
+	int nr)
 {
-	free(buf);
+	int count = (nr - channel->va) & 7;
+	if (count > ((channel->vs - channel->va) & 7))
+	{
+		LOG(LOG_WARNING, "N(R) %d out of the window %d-%d on channel %d", nr, channel->va, channel->vs, channel->id);
+		return;
+	}
+	if (count == 0)
+		return;
+	channel->va = nr;
+	channel->i_first = (channel->i_first + count) % serial.arena_k;
+	channel->t1_expiries = 0;
+	i_frames_timer(channel);
+	channel_update_watch(channel);
 }
 
-/* Writes data to the buffer
+/**
+ * Tells the modem with RNR to hold back the I frames of a channel while
+ * its pty queue is full, in place of FC. RR ends it, or REJ if I frames
+ * were dropped meanwhile.
  *
- * PARAMS
- * buf - pointer to the buffer
- * input - input data (in user memory)
- * length - how many characters should be written
- * RETURNS
- * number of characters written
+ * PARAMS:
+ * channel - the channel
+ * on - 1 to send RNR, 0 to end it
  */
-static int gsm0710_buffer_write(
-	GSM0710_Buffer* buf,
-	const unsigned char *input,
-	int length)
+static void i_frames_busy(
+	Channel* channel,
+	int on)
 {
-	LOG(LOG_DEBUG, "Enter");
-	int c = buf->endp - buf->writep;
-	length = min(length, gsm0710_buffer_free(buf));
-	if (length > c)
-	{
-		memcpy(buf->writep, input, c);
-		memcpy(buf->data, input + c, length - c);
-		buf->writep = buf->data + (length - c);
-	}
-	else
+	int type = on ? GSM0710_TYPE_RNR : channel->busy_dropped ? GSM0710_TYPE_REJ : GSM0710_TYPE_RR;
+	LOG(LOG_DEBUG, "Logical channel %d %s with %d bytes queued",
+		channel->id, on ? "sends RNR" : "is ready again", channel->out_length);
+	write_frame(channel->id, NULL, 0, type | GSM0710_NR(channel->vr));
+	channel->local_busy = on;
+	if (!on)
 	{
-		memcpy(buf->writep, input, length);
-		buf->writep += length;
-		if (buf->writep == buf->endp)
-			buf->writep = buf->data;
+		channel->rej_sent = channel->busy_dropped;
+		channel->busy_dropped = 0;
 	}
-	LOG(LOG_DEBUG, "Leave");
-	return length;
+	channel->ack_pending = 0;
 }
 
 /**
- * destroys a frame
+ * Tells how much received data the pty queue of a channel still holds,
+ * after what was taken for the current batch.
  */
-static void destroy_frame(
-	GSM0710_Frame * frame)
+static int i_frames_in_room(
+	Channel* channel)
 {
-	if (frame->length > 0)
-		free(frame->data);
-	free(frame);
+	return channel->out_size - channel->out_length - channel->in_batch;
 }
 
-/* Gets a frame from buffer. You have to remember to free this frame
- * when it's not needed anymore
+/**
+ * Takes an I frame from the modem. One out of sequence tells of a lost
+ * one, the modem is asked with REJ to send again from there on. One the
+ * pty queue can't hold isn't acknowledged, the modem is told RNR and
+ * sends it again when the queue drained.
  *
- * PARAMS:
- * buf - the buffer, where the frame is extracted
  * RETURNS:
- * frame or null, if there isn't ready frame with given index
+ * 1 if the data is to be taken, 0 if it is dropped
  */
-static GSM0710_Frame* gsm0710_base_buffer_get_frame(
-	GSM0710_Buffer * buf)
+static int i_frame_received(
+	GSM0710_Frame* frame)
 {
-	int end;
-	int length_needed = 5;// channel, type, length, fcs, flag
-	unsigned char *data;
-	unsigned char fcs = 0xFF;
-	GSM0710_Frame *frame = NULL;
-//Find start flag
-	while (!buf->flag_found && gsm0710_buffer_length(buf) > 0)
+	Channel* channel;
+	int ns = (frame->control >> 1) & 7;
+	if (frame->channel >= GSM0710_MAX_CHANNELS)
+		return 0;
+	channel = channellist + frame->channel;
+	if (channel->i_frames != NULL)
+		i_frames_acked(channel, (frame->control >> 5) & 7);
+	if (ns != channel->vr)
 	{
-		if (*buf->readp == GSM0710_FRAME_FLAG)
-			buf->flag_found = 1;
-		gsm0710_buffer_inc(buf, buf->readp);
+		if (channel->local_busy)
+			channel->busy_dropped = 1;
+		else if (!channel->rej_sent)
+		{
+			LOG(LOG_INFO, "I frame %d instead of %d on channel %d, asking for it again", ns, channel->vr, channel->id);
+			write_frame(channel->id, NULL, 0, GSM0710_TYPE_REJ | GSM0710_NR(channel->vr));
+			channel->rej_sent = 1;
+		}
+		return 0;
 	}
-	if (!buf->flag_found)// no frame started
-		return NULL;
-//skip empty frames (this causes troubles if we're using DLC 62)
-	while (gsm0710_buffer_length(buf) > 0 && (*buf->readp == GSM0710_FRAME_FLAG))
+	if (frame->channel > 0 && i_frames_in_room(channel) < frame->length)
 	{
-		gsm0710_buffer_inc(buf, buf->readp);
+		if (!channel->local_busy)
+			i_frames_busy(channel, 1);
+		channel->busy_dropped = 1;
+		if (frame->control & GSM0710_PF)
+			channel->ack_pending = 1 | GSM0710_PF;
+		return 0;
 	}
-	if (gsm0710_buffer_length(buf) >= length_needed)
+	channel->vr = (channel->vr + 1) & 7;
+	channel->rej_sent = 0;
+	if (frame->channel > 0)
+		channel->in_batch += frame->length;
+	channel->ack_pending = 1 | (frame->control & GSM0710_PF);
+	return 1;
+}
+
+/**
+ * Takes a RR, RNR or REJ from the modem.
+ */
+static void s_frame_received(
+	GSM0710_Frame* frame)
+{
+	Channel* channel;
+	if (frame->channel >= GSM0710_MAX_CHANNELS || channellist[frame->channel].i_frames == NULL)
+		return;
+	channel = channellist + frame->channel;
+	i_frames_acked(channel, (frame->control >> 5) & 7);
+	switch (frame->control & 0x0F & ~GSM0710_PF)
 	{
-		data = buf->readp;
-		if ((frame = (GSM0710_Frame*)malloc(sizeof(GSM0710_Frame))) != NULL)
+	case GSM0710_TYPE_RNR:
+		channel->peer_busy = 1;
+		break;
+	case GSM0710_TYPE_REJ:
+		LOG(LOG_INFO, "The modem asks for the I frames from %d on channel %d again", channel->va, channel->id);
+		channel->peer_busy = 0;
+		i_frames_resend(channel);
+		i_frames_timer(channel);
+		break;
+	default:
+		channel->peer_busy = 0;
+		break;
+	}
+	channel_update_watch(channel);
+//we don't poll, so this is the modem asking
+	if (frame->control & GSM0710_PF)
+		channel->ack_pending = 1 | GSM0710_PF;
+}
+
+/**
+ * Acknowledges the I frames received with RR, or RNR while the pty
+ * queue is full, those which didn't go with an I frame sent meanwhile.
+ */
+static void i_frames_ack()
+{
+	int i;
+	for (i = 0; i < GSM0710_MAX_CHANNELS; i++)
+		if (channellist[i].ack_pending)
 		{
-			frame->channel = ((*data & 252) >> 2);
-			fcs = r_crctable[fcs ^ *data];
-			gsm0710_buffer_inc(buf, data);
-			frame->control = *data;
-			fcs = r_crctable[fcs ^ *data];
-			gsm0710_buffer_inc(buf, data);
-			frame->length = (*data & 254) >> 1;
-			fcs = r_crctable[fcs ^ *data];
+			write_frame(i, NULL, 0, (channellist[i].local_busy ? GSM0710_TYPE_RNR : GSM0710_TYPE_RR)
+				| GSM0710_NR(channellist[i].vr) | (channellist[i].ack_pending & GSM0710_PF));
+			channellist[i].ack_pending = 0;
 		}
-		else
-			LOG(LOG_ALERT, "Out of memory, when allocating space for frame");
-		if ((*data & 1) == 0)
-		{
-//Current spec (version 7.1.0) states these kind of
-//frames to be invalid Long lost of sync might be
-//caused if we would expect a long frame because of an
-//error in length field.
-			/*
-			gsm0710_buffer_inc(buf,data);
-			frame->length += (*data*128);
-			fcs = r_crctable[fcs^*data];
-			length_needed++;
-			*/
-			free(frame);
-			buf->readp = data;
-			buf->flag_found = 0;
-			return gsm0710_base_buffer_get_frame(buf);
-		}
-		length_needed += frame->length;
-		if (!(gsm0710_buffer_length(buf) >= length_needed))
-		{
-			free(frame);
-			return NULL;
-		}
-		gsm0710_buffer_inc(buf, data);
-//extract data
-		if (frame->length > 0)
+}
+
+/**
+ * Writes what the pty reader takes from a channel's queue. Clears FC,
+ * or ends RNR, once the queue is down to the low watermark.
+ */
+static void channel_out_drain(
+	Channel* channel)
+{
+	struct iovec iov[2];
+	ssize_t c;
+	while (channel->out_length > 0)
+	{
+		iov[0].iov_base = channel->out + channel->out_head;
+		iov[0].iov_len = min(channel->out_length, channel->out_size - channel->out_head);
+		iov[1].iov_base = channel->out;
+		iov[1].iov_len = channel->out_length - iov[0].iov_len;
+		c = writev(channel->fd, iov, iov[1].iov_len ? 2 : 1);
+		serial.rx_pty_syscalls++;
+		if (c <= 0)
+			break;
+		channel->out_head = (channel->out_head + c) % channel->out_size;
+		channel->out_length -= c;
+	}
+	if (channel->out_fc && channel->out_length <= channel->out_size / 4)
+		channel_flow_control(channel, 0);
+	if (channel->local_busy && channel->out_length <= channel->out_size / 4)
+		i_frames_busy(channel, 0);
+}
+
+gboolean pseudo_device_write(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	Channel* channel = (Channel*)data;
+	LOG(LOG_DEBUG, "Enter");
+	if (condition & (G_IO_HUP | G_IO_ERR))
+	{
+//the reader is gone, pseudo_device_read() closes the channel
+		channel->g_source_out = -1;
+		LOG(LOG_DEBUG, "Leave hup");
+		return FALSE;
+	}
+	channel_out_drain(channel);
+	if (channel->out_length > 0)
+		return TRUE;
+	channel->g_source_out = -1;
+	LOG(LOG_DEBUG, "Leave queue drained");
+	return FALSE;
+}
+
+/**
+ * Hands received data to the pty of a channel with a single writev().
+ * What the reader doesn't take right away is queued and written when
+ * the pty becomes writable, from the high watermark on the modem is
+ * held back with FC, or with RNR in the error recovery mode.
+ *
+ * PARAMS:
+ * channel - the channel
+ * iov - the data received, the payloads of one or more frames
+ * count - number of iovecs
+ */
+static void channel_deliver(
+	Channel* channel,
+	const struct iovec *iov,
+	int count)
+{
+	ssize_t written = 0;
+	int i, length, tail, run;
+	channel->in_batch = 0;
+	if (channel->fd < 0)
+	{
+		LOG(LOG_WARNING, "Data for the closed channel %d, dropping %d frames", channel->id, count);
+		return;
+	}
+//keep the order, only write directly when nothing is queued
+	if (channel->out_length == 0)
+	{
+		written = writev(channel->fd, iov, count);
+		serial.rx_pty_syscalls++;
+		if (written < 0)
 		{
-			if ((frame->data = malloc(sizeof(char) * frame->length)) != NULL)
-			{
-				end = buf->endp - data;
-				if (frame->length > end)
-				{
-					memcpy(frame->data, data, end);
-					memcpy(frame->data + end, buf->data, frame->length - end);
-					data = buf->data + (frame->length - end);
-				}
-				else
-				{
-					memcpy(frame->data, data, frame->length);
-					data += frame->length;
-					if (data == buf->endp)
-						data = buf->data;
-				}
-				if (GSM0710_FRAME_IS(GSM0710_TYPE_UI, frame))
-				{
-					for (end = 0; end < frame->length; end++)
-						fcs = r_crctable[fcs ^ (frame->data[end])];
-				}
-			}
-			else
-			{
-				LOG(LOG_ALERT, "Out of memory, when allocating space for frame data");
-				frame->length = 0;
-			}
+			if (errno != EAGAIN)
+				LOG(LOG_WARNING, "Couldn't write to pty channel %d: '%s' (code: %d)", channel->id, strerror(errno), errno);
+			written = 0;
 		}
-//check FCS
-		if (r_crctable[fcs ^ (*data)] != 0xCF)
+		LOG(LOG_DEBUG, "Written %d bytes of %d frames to pty channel %d", (int)written, count, channel->id);
+	}
+	serial.rx_pty_frames += count;
+//queue the rest
+	for (i = 0; i < count; i++)
+	{
+		const unsigned char *data = iov[i].iov_base;
+		length = iov[i].iov_len;
+		if (written >= length)
 		{
-			LOG(LOG_WARNING, "Dropping frame: FCS doesn't match");
-			destroy_frame(frame);
-			buf->flag_found = 0;
-			buf->dropped_count++;
-			buf->readp = data;
-			return gsm0710_base_buffer_get_frame(buf);
+			written -= length;
+			continue;
 		}
-		else
+		data += written;
+		length -= written;
+		written = 0;
+		if (length > channel->out_size - channel->out_length)
 		{
-//check end flag
-			gsm0710_buffer_inc(buf, data);
-			if (*data != GSM0710_FRAME_FLAG)
-			{
-				LOG(LOG_WARNING, "Dropping frame: End flag not found. Instead: %d", *data);
-				destroy_frame(frame);
-				buf->flag_found = 0;
-				buf->dropped_count++;
-				buf->readp = data;
-				return gsm0710_base_buffer_get_frame(buf);
-			}
-			else
-				buf->received_count++;
-			gsm0710_buffer_inc(buf, data);
+			LOG(LOG_WARNING, "Pty queue overflow, data loss: needed to queue %d bytes, room for %d, channel %d",
+				length, channel->out_size - channel->out_length, channel->id);
+			length = channel->out_size - channel->out_length;
 		}
-		buf->readp = data;
+		tail = (channel->out_head + channel->out_length) % channel->out_size;
+		run = min(length, channel->out_size - tail);
+		memcpy(channel->out + tail, data, run);
+		memcpy(channel->out, data + run, length - run);
+		channel->out_length += length;
+	}
+	if (channel->out_length == 0)
+		return;
+	if (channel->g_source_out == (guint)-1)
+		channel->g_source_out = mux_watch_add(channel->g_channel, G_IO_OUT, pseudo_device_write, channel);
+	if (channel->out_length < channel->out_size / 4 * 3)
+		return;
+	if (channel->i_frames != NULL)
+	{
+		if (!channel->local_busy)
+			i_frames_busy(channel, 1);
 	}
-	return frame;
+	else if (!channel->out_fc)
+		channel_flow_control(channel, 1);
 }
 
-/* Gets a advanced option frame from buffer. You have to remember to free this frame
- * when it's not needed anymore
+/**
+ * Writes the payloads of the frames collected from one serial read to
+ * the ptys, all frames of a channel with one writev().
  *
  * PARAMS:
- * buf - the buffer, where the frame is extracted
- * RETURNS:
- * frame or null, if there isn't ready frame with given index
+ * iov - the payloads in the order received, emptied
+ * iov_channel - the channel of each payload
+ * count - number of payloads, set to 0
  */
-static GSM0710_Frame *gsm0710_advanced_buffer_get_frame(
-	GSM0710_Buffer * buf)
+static void channel_deliver_batch(
+	struct iovec *iov,
+	unsigned char *iov_channel,
+	int *count)
+{
+	struct iovec channel_iov[GSM0710_RX_FRAMES];
+	int i, j, n;
+	for (i = 0; i < *count; i++)
+	{
+		if (iov[i].iov_base == NULL)// went with an earlier writev()
+			continue;
+		for (n = 0, j = i; j < *count; j++)
+			if (iov[j].iov_base != NULL && iov_channel[j] == iov_channel[i])
+			{
+				channel_iov[n++] = iov[j];
+				iov[j].iov_base = NULL;
+			}
+		channel_deliver(channellist + iov_channel[i], channel_iov, n);
+	}
+	*count = 0;
+}
+
+static gboolean watchdog(gpointer data);
+static void resume_done(Serial* serial);
+static void cache_save(Serial* serial);
+static void cache_forget(Serial* serial);
+static void rpn_start(Serial* serial);
+static void watchdog_start(Serial* serial);
+static void watchdog_stop(Serial* serial);
+static int close_devices();
+
+static gboolean c_get_power(const char* origin)
 {
 	LOG(LOG_DEBUG, "Enter");
-l_begin:
-//Find start flag
-	while (!buf->flag_found && gsm0710_buffer_length(buf) > 0)
+	LOG(LOG_DEBUG, "Leave");
+	return serial.state != MUX_STATE_OFF;
+}
+
+static gboolean c_set_power(const char* origin, gboolean on)
+{
+	LOG(LOG_DEBUG, "Enter");
+	if (on)
 	{
-		if (*buf->readp == GSM0710_FRAME_ADV_FLAG)
+		if (serial.state == MUX_STATE_OFF)
 		{
-			buf->flag_found = 1;
-			buf->adv_length = 0;
-			buf->adv_found_esc = 0;
+			LOG(LOG_INFO, "power on");
+			serial.state = MUX_STATE_OPENING;
+			watchdog(&serial);
 		}
-		gsm0710_buffer_inc(buf, buf->readp);
+		else
+			LOG(LOG_WARNING, "power on request received but was already on");
 	}
-	if (!buf->flag_found)// no frame started
-		return NULL;
-	if (0 == buf->adv_length)
-//skip empty frames (this causes troubles if we're using DLC 62)
-		while (gsm0710_buffer_length(buf) > 0 && (*buf->readp == GSM0710_FRAME_ADV_FLAG))
-			gsm0710_buffer_inc(buf, buf->readp);
-	while (gsm0710_buffer_length(buf) > 0)
+	else
 	{
-		if (!buf->adv_found_esc && GSM0710_FRAME_ADV_FLAG == *(buf->readp))
-		{// closing flag found
-			GSM0710_Frame *frame = NULL;
-			unsigned char *data = buf->adv_data;
-			unsigned char fcs = 0xFF;
-			gsm0710_buffer_inc(buf, buf->readp);
-			if (buf->adv_length < 3)
-			{
-				LOG(LOG_WARNING, "Too short adv frame, length:%d", buf->adv_length);
-				buf->flag_found = 0;
-				goto l_begin;
-			}
-			if ((frame = (GSM0710_Frame*)malloc(sizeof(GSM0710_Frame))) != NULL)
-			{
-				frame->channel = ((data[0] & 252) >> 2);
-				fcs = r_crctable[fcs ^ data[0]];
-				frame->control = data[1];
-				fcs = r_crctable[fcs ^ data[1]];
-				frame->length = buf->adv_length - 3;
-			}
-			else
-				LOG(LOG_ALERT, "Out of memory, when allocating space for frame");
-//extract data
-			if (frame->length > 0)
-			{
-				if ((frame->data = (unsigned char *) malloc(sizeof(char) * frame->length)))
-				{
-					memcpy(frame->data, data + 2, frame->length);
-					if (GSM0710_FRAME_IS(GSM0710_TYPE_UI, frame))
-					{
-						int i;
-						for (i = 0; i < frame->length; ++i)
-							fcs = r_crctable[fcs ^ (frame->data[i])];
-					}
-				}
-				else
-				{
-					LOG(LOG_ALERT, "Out of memory, when allocating space for frame data");
-					buf->flag_found = 0;
-					goto l_begin;
-				}
-			}
-//check FCS
-			if (r_crctable[fcs ^ data[buf->adv_length - 1]] != 0xCF)
-			{
-				LOG(LOG_WARNING, "Dropping frame: FCS doesn't match");
-				destroy_frame(frame);
-				buf->flag_found = 0;
-				buf->dropped_count++;
-				goto l_begin;
-			}
-			else
-			{
-				buf->received_count++;
-				buf->flag_found = 0;
-				LOG(LOG_DEBUG, "Leave success");
-				return frame;
-			}
-		}
-		if (buf->adv_length >= sizeof(buf->adv_data))
-		{
-			LOG(LOG_WARNING, "Too long adv frame, length:%d", buf->adv_length);
-			buf->flag_found = 0;
-			buf->dropped_count++;
-			goto l_begin;
-		}
-		if (buf->adv_found_esc)
+		if (serial.state == MUX_STATE_MUXING)
 		{
-			buf->adv_data[buf->adv_length] = *(buf->readp) ^ GSM0710_FRAME_ADV_ESC_COPML;
-			buf->adv_length++;
-			buf->adv_found_esc = 0;
+			LOG(LOG_INFO, "power off");
+			watchdog_stop(&serial);
+			close_devices();
 		}
-		else if (GSM0710_FRAME_ADV_ESC == *(buf->readp))
-			buf->adv_found_esc = 1;
 		else
-		{
-			buf->adv_data[buf->adv_length] = *(buf->readp);
-			buf->adv_length++;
-		}
-		gsm0710_buffer_inc(buf, buf->readp);
+			LOG(LOG_WARNING, "power off received but wasn't on/muxing");
 	}
-	return NULL;
+	LOG(LOG_DEBUG, "Leave");
+	return TRUE;
+}
+
+static gboolean c_reset_modem(const char* origin)
+{
+	LOG(LOG_DEBUG, "Enter");
+	LOG(LOG_INFO, "modem reset");
+	serial.state = MUX_STATE_CLOSING;				
+	return TRUE;
 }
 
 /**
- * Returns 1 if found, 0 otherwise. needle must be null-terminated.
- * strstr might not work because WebBox sends garbage before the first
- * OK
+ * Opens the pty of a channel and starts reading it.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
  */
-static int memstr(
-	const char *haystack,
-	int length,
-	const char *needle)
+static int channel_pty_open(
+	Channel* channel,
+	const char* origin)
 {
-	int i;
-	int j = 0;
-	if (needle[0] == '\0')
-		return 1;
-	for (i = 0; i < length; i++)
-		if (needle[j] == haystack[i])
-		{
-			j++;
-			if (needle[j] == '\0') // Entire needle was found
-				return 1;
-		}
-		else
-			j = 0;
+	snprintf(channel->origin, sizeof(channel->origin), "%s", origin);
+	SYSCHECK(channel->fd = open(channel->devicename, O_RDWR | O_NONBLOCK)); //open devices
+	char* pts = ptsname(channel->fd);
+	if (pts == NULL) SYSCHECK(-1);
+	snprintf(channel->ptsname, sizeof(channel->ptsname), "%s", pts);
+	struct termios options;
+	tcgetattr(channel->fd, &options); //get the parameters
+	options.c_lflag &= ~(ICANON | ECHO | ECHOE | ISIG); //set raw input
+	options.c_iflag &= ~(INLCR | ICRNL | IGNCR);
+	options.c_oflag &= ~(OPOST| OLCUC| ONLRET| ONOCR| OCRNL); //set raw output
+	tcsetattr(channel->fd, TCSANOW, &options);
+	if (!strcmp(channel->devicename, "/dev/ptmx"))
+	{
+		//Otherwise programs cannot access the pseudo terminals
+		SYSCHECK(grantpt(channel->fd));
+		SYSCHECK(unlockpt(channel->fd));
+	}
+	channel->v24_signals = GSM0710_SIGNAL_DV | GSM0710_SIGNAL_RTR | GSM0710_SIGNAL_RTC | GSM0710_EA;
+	channel->g_channel = g_io_channel_unix_new(channel->fd);
+	g_io_channel_set_encoding(channel->g_channel, NULL, NULL );
+	channel_update_watch(channel);
 	return 0;
 }
 
-/*
- * Sends an AT-command to a given serial port and waits for reply. 
- * PARAMS: fd - file descriptor cmd - command to - how many
- * seconds to wait for response RETURNS: 
- * 0 on success (OK-response), -1 otherwise
- */
-static int chat(
-	int serial_device_fd,
-	char *cmd,
-	int to)
+/**
+ * Sends the SABM of a channel again while there is no UA, gives up
+ * after GSM0710_WRITE_RETRIES.
+ */
+static gboolean channel_alloc_timeout(
+	gpointer data)
 {
+	Channel* channel = (Channel*)data;
 	LOG(LOG_DEBUG, "Enter");
-	unsigned char buf[1024];
-	int sel;
-	int len;
-	int wrote = 0;
-	syslogdump(">s ", (unsigned char *) cmd, strlen(cmd));
-	SYSCHECK(wrote = write(serial_device_fd, cmd, strlen(cmd)));
-	LOG(LOG_DEBUG, "Wrote %d bytes", wrote);
-	SYSCHECK(tcdrain(serial_device_fd));
-
-	fd_set rfds;
-	FD_ZERO(&rfds);
-	FD_SET(serial_device_fd, &rfds);
-	struct timeval timeout;
-	timeout.tv_sec = to;
-	timeout.tv_usec = 0;
-	do
+	if (++channel->alloc_retries < GSM0710_WRITE_RETRIES)
 	{
-		SYSCHECK(sel = select(serial_device_fd + 1, &rfds, NULL, NULL, &timeout));
-		LOG(LOG_DEBUG, "Selected %d", sel);
-		if (FD_ISSET(serial_device_fd, &rfds))
-		{
-			memset(buf, 0, sizeof(buf));
-			len = read(serial_device_fd, buf, sizeof(buf));
-			SYSCHECK(len);
-			LOG(LOG_DEBUG, "Read %d bytes from serial device", len);
-			syslogdump("<s ", buf, len);
-			errno = 0;
-			if (memstr((char *) buf, len, "OK"))
-			{
-				LOG(LOG_DEBUG, "Received OK");
-				return 0;
-			}
-			if (memstr((char *) buf, len, "ERROR"))
-			{
-				LOG(LOG_DEBUG, "Received ERROR");
-				return -1;
-			}
-		}
-	} while (sel);
-	return -1;
+		LOG(LOG_DEBUG, "No UA for channel %d yet, sending SABM again", channel->id);
+		write_frame(channel->id, NULL, 0, GSM0710_TYPE_SABM | GSM0710_PF);
+		return TRUE;
+	}
+	LOG(LOG_INFO, "Unable to open the new channel %d", channel->id);
+//the timer ends with this call
+	channel->g_source_alloc = -1;
+	channel_alloc_reply(channel, "No answer from the modem");
+	logical_channel_close(channel);
+	return FALSE;
 }
 
-/*
- * Handles commands received from the control channel.
+/**
+ * Proposes the parameters of a channel about to be opened with PN, the
+ * channel class comes from the origin given to AllocChannel. Bulk data
+ * channels ask for the largest frames of the mux-mode, interactive ones
+ * for small frames not to wait for them. Until the modem answers, or if
+ * it doesn't know PN, the proposed frame size is used for sending.
+ *
+ * PARAMS:
+ * channel - the channel with its origin set
  */
-static int handle_command(
-	GSM0710_Frame * frame)
+static void channel_negotiate(
+	Channel* channel)
+{
+	unsigned char pn[10];
+	int i, bulk = 0;
+	for (i = 0; bulk_origins[i] != NULL; i++)
+		if (strstr(channel->origin, bulk_origins[i]) != NULL)
+			bulk = 1;
+	channel->N1 = bulk ? cmux_N1 : min(cmux_N1, GSM0710_INTERACTIVE_N1);
+	channel->k = bulk ? GSM0710_BULK_K : GSM0710_INTERACTIVE_K;
+	LOG(LOG_INFO, "Proposing %s channel %d frames of %d bytes, window %d",
+		bulk ? "bulk" : "interactive", channel->id, channel->N1, channel->k);
+	pn[0] = GSM0710_CONTROL_PN | GSM0710_CR;
+	pn[1] = GSM0710_EA | (8 << 1);
+	pn[2] = channel->id;
+	pn[3] = error_recovery() ? 2 : 0;// I or UIH frames, convergence layer 1
+	pn[4] = channel->id | 7;// the default priority
+	pn[5] = cmux_T1;
+	pn[6] = channel->N1 & 0xFF;
+	pn[7] = channel->N1 >> 8;
+	pn[8] = cmux_N2;
+	pn[9] = channel->k;
+	write_frame(0, pn, sizeof(pn), GSM0710_TYPE_UIH);
+}
+
+/**
+ * Takes the parameters of a PN command or response. A command is
+ * answered with the values changed to what is accepted, the response
+ * being the acknowledge echoing it.
+ *
+ * PARAMS:
+ * value - the 8 value bytes of the PN, changed for a command
+ * length - their length
+ * command - whether the modem proposes
+ */
+static void channel_negotiated(
+	unsigned char *value,
+	int length,
+	int command)
+{
+	Channel* channel;
+	int N1;
+	if (length < 8 || (value[0] & 63) == 0 || (value[0] & 63) >= GSM0710_MAX_CHANNELS)
+	{
+		LOG(LOG_WARNING, "Parameter negotiation with %d bytes for channel %d ignored", length, length > 0 ? value[0] & 63 : -1);
+		return;
+	}
+	channel = channellist + (value[0] & 63);
+	N1 = value[4] | (value[5] << 8);
+//the modem answers with at most the proposed values, it proposes what
+//it wants to receive and won't get larger frames than the mux-mode's
+	if (command)
+		N1 = min(N1, cmux_N1);
+	else
+		N1 = min(N1, channel->N1);
+	if (N1 <= 0)
+	{
+		LOG(LOG_WARNING, "Frame size %d for channel %d ignored", N1, channel->id);
+		return;
+	}
+	channel->N1 = N1;
+	channel->k = value[7] & 7;
+	if (command)
+	{
+		value[4] = N1 & 0xFF;
+		value[5] = N1 >> 8;
+	}
+	LOG(LOG_INFO, "Channel %d sends frames of %d bytes, window %d", channel->id, channel->N1, channel->k);
+}
+
+/**
+ * Starts opening a free channel for an AllocChannel call. The call is
+ * answered with the pty name when the UA arrives, the main loop keeps
+ * running meanwhile, so several channels are opened at once.
+ *
+ * PARAMS:
+ * origin - who asked for the channel, for logging
+ * context - the call, answered with alloc_channel_reply()
+ * RETURNS:
+ * FALSE if the call was answered with an error right away
+ */
+static gboolean c_alloc_channel(const char* origin, DBusGMethodInvocation* context)
 {
 	LOG(LOG_DEBUG, "Enter");
-	unsigned char type, signals;
-	int length = 0, i, type_length, channel, supported = 1;
-	unsigned char *response;
-//struct ussp_operation op;
-	if (frame->length > 0)
+	int i;
+	if (context == NULL)
+		return FALSE;
+	if (origin == NULL)
 	{
-		type = frame->data[0];// only a byte long types are handled now skip extra bytes
-		for (i = 0; (frame->length > i && (frame->data[i] & GSM0710_EA) == 0); i++);
-		i++;
-		type_length = i;
-		if ((type & GSM0710_CR) == GSM0710_CR)
-		{
-//command not ack extract frame length
-			while (frame->length > i)
-			{
-				length = (length * 128) + ((frame->data[i] & 254) >> 1);
-				if ((frame->data[i] & 1) == 1)
-					break;
-				i++;
-			}
-			i++;
-			switch ((type & ~GSM0710_CR))
+		alloc_channel_reply(context, NULL, "No origin given");
+		return FALSE;
+	}
+	if (serial.state == MUX_STATE_MUXING)
+		for (i=1;i<GSM0710_MAX_CHANNELS;i++)
+			if (channellist[i].fd < 0 && !channellist[i].closing) // is this channel free?
 			{
-			case GSM0710_CONTROL_CLD:
-				LOG(LOG_INFO, "The mobile station requested mux-mode termination");
-				serial.state = MUX_STATE_CLOSING;				
-				break;
-			case GSM0710_CONTROL_PSC:
-				LOG(LOG_DEBUG, "Power Service Control command: ***");
-				LOG(LOG_DEBUG, "Frame->data = %s / frame->length = %d", frame->data + i, frame->length - i);
-			break;
-			case GSM0710_CONTROL_TEST:
-				LOG(LOG_DEBUG, "Test command: ");
-				LOG(LOG_DEBUG, "Frame->data = %s / frame->length = %d", frame->data + i, frame->length - i);
-				//serial->ping_number = 0;
-				break;
-			case GSM0710_CONTROL_MSC:
-				if (i + 1 < frame->length)
+				LOG(LOG_DEBUG, "Found channel %d fd %d on %s", i, channellist[i].fd, channellist[i].devicename);
+				if (channel_pty_open(channellist+i, origin) < 0)
 				{
-					channel = ((frame->data[i] & 252) >> 2);
-					i++;
-					signals = (frame->data[i]);
-//op.op = USSP_MSC;
-//op.arg = USSP_RTS;
-//op.len = 0;
-					LOG(LOG_DEBUG, "Modem status command on channel %d", channel);
-					if ((signals & GSM0710_SIGNAL_FC) == GSM0710_SIGNAL_FC)
-						LOG(LOG_DEBUG, "No frames allowed");
-					else
+					logical_channel_close(channellist+i);
+					alloc_channel_reply(context, NULL, "Couldn't open a pty");
+					return FALSE;
+				}
+				LOG(LOG_INFO, "Connecting %s to virtual channel %d for %s on %s",
+					channellist[i].ptsname, channellist[i].id, channellist[i].origin, serial.devicename);
+				channellist[i].alloc_context = context;
+				channellist[i].alloc_retries = 0;
+				channellist[i].g_source_alloc = g_timeout_add_seconds(3, channel_alloc_timeout, channellist+i);
+				channel_negotiate(channellist+i);
+				write_frame(i, NULL, 0, GSM0710_TYPE_SABM | GSM0710_PF);
+				return TRUE;
+			}
+	LOG(LOG_WARNING, "not muxing or no free channel found");
+	alloc_channel_reply(context, NULL, "All channels are used");
+	return FALSE;
+}
+
+static void my_log_handler(
+	const gchar *log_domain,
+	GLogLevelFlags log_level,
+	const gchar *message,
+	gpointer user_data)
+{
+	LOG(LOG_INFO, "%d %s %s", log_level, log_domain, message);
+}
+
+#include "muxercontrol.c"
+#include "mux-glue.h"
+
+/**
+ * Answers an AllocChannel call.
+ *
+ * PARAMS:
+ * context - the call
+ * channel - the pty name of the open channel, NULL if it failed
+ * error - why it failed
+ */
+static void alloc_channel_reply(
+	DBusGMethodInvocation* context,
+	const char* channel,
+	const char* error)
+{
+	if (channel == NULL)
+	{
+		GError* g_err = g_error_new(MUXER_ERROR, MUXER_ALLOC_ERROR, "%s", error);
+		dbus_g_method_return_error(context, g_err);
+		g_error_free(g_err);
+	}
+	else
+		dbus_g_method_return(context, channel);
+}
+
+static int dbus_init()
+{
+	g_log_set_handler(NULL, G_LOG_LEVEL_MASK, my_log_handler, NULL);
+	g_type_init();
+	g_log_set_always_fatal(G_LOG_LEVEL_WARNING);
+	GError* g_err = NULL;
+	g_conn = dbus_g_bus_get(DBUS_BUS_SYSTEM, &g_err);
+	if (g_err != NULL)
+	{
+		//g_printerr
+		LOG(LOG_ERR, "Connecting to system bus failed: %s", g_err->message);
+		g_error_free(g_err);
+		return -1;
+	}
+	GObject* obj = (GObject*)muxer_control_gen();
+	DBusError err;
+	memset(&err, 0, sizeof(err));
+	if (dbus_bus_request_name(dbus_g_connection_get_connection(g_conn), "org.pyneo.muxer", DBUS_NAME_FLAG_ALLOW_REPLACEMENT|DBUS_NAME_FLAG_REPLACE_EXISTING, &err) < 0)
+	{
+		if (dbus_error_is_set(&err))
+			LOG(LOG_ERR, "dbus error with dbus_bus_request_name '%s' '%s'", err.name, err.message);
+		else
+			LOG(LOG_ERR, "dbus error with dbus_bus_request_name");
+		return -1;
+	}
+	dbus_g_object_type_install_info(TYPE_MUXER_CONTROL, &dbus_glib_mux_object_info);
+	dbus_g_connection_register_g_object(g_conn, object_name, obj);
+	return 0;
+}
+
+static int dbus_deinit()
+{
+	if (g_conn)
+		dbus_g_connection_unref(g_conn);
+	return 0;
+}
+
+static int dbus_signal_send_deactivate(const char* sigvalue)
+{
+	DBusConnection* conn = dbus_g_connection_get_connection(g_conn);
+	if (NULL == conn)
+	{
+		LOG(LOG_ERR, "Connection null"); 
+		return -1;
+	}
+	DBusMessage* msg = dbus_message_new_signal(object_name, // object name of the signal
+		"org.freesmartphone.GSM.MUX", // interface name of the signal
+		"deactivate"); // name of the signal
+	if (NULL == msg) 
+	{ 
+		LOG(LOG_ERR, "Message Null"); 
+		return -1;
+	}
+	DBusMessageIter args;
+	dbus_message_iter_init_append(msg, &args); // append arguments onto signal
+	if (!dbus_message_iter_append_basic(&args, DBUS_TYPE_STRING, &sigvalue))
+	{ 
+		LOG(LOG_ERR, "Out Of Memory"); 
+		return -1;
+	}
+	dbus_uint32_t g_serial = 0; // unique number to associate replies with requests
+	if (!dbus_connection_send(conn, msg, &g_serial)) // send the message and flush the connection
+	{ 
+		LOG(LOG_ERR, "Out Of Memory"); 
+		return -1;
+	}
+	dbus_connection_flush(conn);
+	// free the message 
+	dbus_message_unref(msg);
+	return 0;
+}
+
+/**
+	GPtrArray *table = parse("(14-5),(3-7),(4-9),(33)");
+
+	for(int i = 0; i < table->len; i++)
+	{
+		int *arr = g_ptr_array_index(table, i);
+		printf("(%d, %d)\n", arr[0], arr[1]);
+	}
+*/
+GPtrArray* parse(const gchar* str)
+{
+	GPtrArray *table = g_ptr_array_new();
+	int i = -1;
+	int first = -1;
+	int pos = 0;
+	int inside = 0;
+	while(str[++i] != 0)
+	{
+		if(str[i] == '(')
+		{
+			pos = i+1;
+			first = -1;
+			inside = 1;
+		}
+		else if(str[i] == ',' && inside)
+		{
+//a list like (0,1) is taken as the range from its first to its last value
+			if(first == -1)
+				first = atoi(str + pos);
+			pos = i+1;
+		}
+		else if(str[i] == ')')
+		{
+			int *tuple = malloc(sizeof(int)*2);
+			
+			tuple[1] = atoi(str + pos);
+			tuple[0] = first == -1 ? tuple[1] : first;
+			
+			g_ptr_array_add(table, (gpointer)tuple);
+			inside = 0;
+		}
+		else if(str[i] == '-')
+		{
+			first = atoi(str + pos);
+			pos = i+1;
+		}
+	}
+	return table;
+}
+
+//////////////////////////////////////////////// real functions
+/* Maps a ring twice back to back from a memfd (a file in /dev/shm for
+ * kernels without memfd_create), followed by extra bytes of plain
+ * memory.
+ *
+ * PARAMS:
+ * ring - size of the ring, a power of two and at least a page
+ * extra - bytes mapped behind the mirror
+ * RETURNS:
+ * the memory, NULL on error
+ */
+static unsigned char *mirror_map(
+	unsigned long ring,
+	unsigned long extra)
+{
+	unsigned char *p;
+	int fd = -1;
+#ifdef SYS_memfd_create
+	fd = syscall(SYS_memfd_create, "gsm0710muxd", 0);
+#endif
+	if (fd < 0)
+	{
+		char name[] = "/dev/shm/gsm0710muxd.XXXXXX";
+		if ((fd = mkstemp(name)) >= 0)
+			unlink(name);
+	}
+	if (fd < 0)
+	{
+		LOG(LOG_ERR, "system-error: '%s' (code: %d)", strerror(errno), errno);
+		return NULL;
+	}
+	if (ftruncate(fd, ring) < 0
+		|| (p = mmap(NULL, 2 * ring + extra, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+	{
+		LOG(LOG_ERR, "system-error: '%s' (code: %d)", strerror(errno), errno);
+		close(fd);
+		return NULL;
+	}
+	if (mmap(p, ring, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+		|| mmap(p + ring, ring, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+		|| (extra > 0 && mprotect(p + 2 * ring, extra, PROT_READ | PROT_WRITE) < 0))
+	{
+		LOG(LOG_ERR, "system-error: '%s' (code: %d)", strerror(errno), errno);
+		munmap(p, 2 * ring + extra);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	return p;
+}
+
+/* Initializes a buffer and maps its memory: the mirrored ring and the
+ * room for unescaped advanced option frames behind it. That takes all
+ * frames decoded from a ring full of data, so they stay valid until
+ * gsm0710_buffer_release().
+ *
+ * PARAMS:
+ * buf - the buffer to be initialized
+ * size - minimum size of the ring, rounded up to a power of two and a
+ * page
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+static int gsm0710_buffer_init(
+	GSM0710_Buffer* buf,
+	int size)
+{
+	unsigned long ring = getpagesize();
+	unsigned char *p;
+	memset(buf, 0, sizeof(GSM0710_Buffer));
+	while (ring < size)
+		ring <<= 1;
+	if ((p = mirror_map(ring, 2 * ring)) == NULL)
+		return -1;
+	buf->data = p;
+	buf->size = ring;
+	buf->mask = ring - 1;
+	buf->adv_data = p + 2 * ring;
+	LOG(LOG_DEBUG, "Receive ring of %lu bytes", ring);
+	return 0;
+}
+
+/* Unmaps the memory of a buffer.
+ *
+ * PARAMS:
+ * buf - the buffer to be destroyed
+ */
+static void gsm0710_buffer_destroy(
+	GSM0710_Buffer* buf)
+{
+	if (buf->data)
+		munmap(buf->data, 4 * buf->size);
+	buf->data = NULL;
+	buf->adv_data = NULL;
+}
+
+/* Tells the buffer the frames taken from it so far are done with, so
+ * their payloads may be overwritten. Has to be called before more data
+ * is written to the buffer.
+ *
+ * PARAMS:
+ * buf - the buffer
+ */
+static void gsm0710_buffer_release(
+	GSM0710_Buffer* buf)
+{
+//the frame in progress moves to the front
+	if (buf->adv_start > 0)
+	{
+		if (buf->flag_found)
+			memmove(buf->adv_data, buf->adv_data + buf->adv_start, buf->adv_length);
+		buf->adv_start = 0;
+	}
+}
+
+/* Initializes a ring between two threads and maps its memory.
+ *
+ * PARAMS:
+ * ring - the ring to be initialized
+ * size - minimum size, rounded up to a power of two and a page
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+static int ring_init(
+	GSM0710_Ring* ring,
+	int size)
+{
+	unsigned int length = getpagesize();
+	memset(ring, 0, sizeof(GSM0710_Ring));
+	while (length < size)
+		length <<= 1;
+	if ((ring->data = mirror_map(length, 0)) == NULL)
+		return -1;
+	ring->size = length;
+	return 0;
+}
+
+/* Unmaps the memory of a ring.
+ *
+ * PARAMS:
+ * ring - the ring to be destroyed
+ */
+static void ring_destroy(
+	GSM0710_Ring* ring)
+{
+	if (ring->data)
+		munmap(ring->data, 2 * ring->size);
+	ring->data = NULL;
+}
+
+/* Allocates the memory the mux session needs on the data path, so
+ * muxing itself doesn't touch the heap. Sized for N1 and
+ * GSM0710_MAX_CHANNELS.
+ */
+static int session_open(
+	Serial* serial)
+{
+	if (serial->in_buf)
+		gsm0710_buffer_destroy(serial->in_buf);
+	free(serial->arena.base);
+	serial->tx_queue.size = GSM0710_QUEUE_FRAMES * GSM0710_ADV_FRAME_SIZE(cmux_N1);
+	tx_queue_reset(serial);
+	serial->arena.used = 0;
+	serial->arena_N1 = cmux_N1;
+	serial->arena_k = error_recovery() ? cmux_k : 0;
+	serial->arena.size = sizeof(GSM0710_Buffer)
+		+ serial->tx_queue.size
+		+ GSM0710_MAX_CHANNELS * cmux_N1
+		+ GSM0710_MAX_CHANNELS * GSM0710_PTY_QUEUE_SIZE(cmux_N1)
+		+ GSM0710_MAX_CHANNELS * serial->arena_k * cmux_N1
+		+ (2 + 3 * GSM0710_MAX_CHANNELS) * sizeof(void *);// alignment
+	if ((serial->arena.base = malloc(serial->arena.size)) == NULL)
+	{
+		LOG(LOG_ALERT, "Out of memory");
+		serial->arena.size = 0;
+		serial->in_buf = NULL;
+		return -1;
+	}
+	serial->in_buf = arena_alloc(&serial->arena, sizeof(GSM0710_Buffer));
+	serial->tx_queue.data = arena_alloc(&serial->arena, serial->tx_queue.size);
+//the ring has to hold at least two frames of the largest kind
+	if (gsm0710_buffer_init(serial->in_buf, max(buffer_size, 2 * GSM0710_ADV_FRAME_SIZE(cmux_N1))) < 0)
+	{
+		free(serial->arena.base);
+		serial->arena.base = NULL;
+		serial->arena.size = 0;
+		serial->in_buf = NULL;
+		return -1;
+	}
+	LOG(LOG_DEBUG, "Session arena of %d bytes", (int)serial->arena.size);
+	return 0;
+}
+
+/* Releases the memory of the mux session.
+ */
+static void session_close(
+	Serial* serial)
+{
+	if (serial->in_buf)
+		gsm0710_buffer_destroy(serial->in_buf);
+	free(serial->arena.base);
+	serial->arena.base = NULL;
+	serial->arena.size = 0;
+	serial->arena.used = 0;
+	serial->in_buf = NULL;
+	serial->tx_queue.data = NULL;
+	tx_queue_reset(serial);
+}
+
+/* Writes data to the buffer
+ *
+ * PARAMS
+ * buf - pointer to the buffer
+ * input - input data (in user memory)
+ * length - how many characters should be written
+ * RETURNS
+ * number of characters written
+ */
+static int gsm0710_buffer_write(
+	GSM0710_Buffer* buf,
+	const unsigned char *input,
+	int length)
+{
+	LOG(LOG_DEBUG, "Enter");
+	length = min(length, gsm0710_buffer_free(buf));
+	memcpy(gsm0710_buffer_writep(buf), input, length);
+	buf->writei += length;
+	LOG(LOG_DEBUG, "Leave");
+	return length;
+}
+
+/* Gets a frame from buffer. The frame's payload points into the
+ * buffer, nothing is allocated.
+ *
+ * PARAMS:
+ * buf - the buffer, where the frame is extracted
+ * frame - gets the extracted frame
+ * RETURNS:
+ * 1 if a frame was extracted, 0 if there isn't ready frame
+ */
+static int gsm0710_base_buffer_get_frame(
+	GSM0710_Buffer * buf,
+	GSM0710_Frame * frame)
+{
+	int i, header_length;
+	int length_needed = 5;// channel, type, length, fcs, flag
+	unsigned char *data;
+	unsigned char fcs = 0xFF;
+//Find start flag
+	if (!buf->flag_found && gsm0710_buffer_length(buf) > 0)
+	{
+		data = gsm0710_buffer_readp(buf);
+		unsigned char *flag = memchr(data, GSM0710_FRAME_FLAG, gsm0710_buffer_length(buf));
+		if (flag)
+		{
+			buf->flag_found = 1;
+			buf->readi += flag - data + 1;
+		}
+		else
+			buf->readi = buf->writei;
+	}
+	if (!buf->flag_found)// no frame started
+		return 0;
+//skip empty frames (this causes troubles if we're using DLC 62)
+	while (gsm0710_buffer_length(buf) > 0 && (*gsm0710_buffer_readp(buf) == GSM0710_FRAME_FLAG))
+		buf->readi++;
+	if (gsm0710_buffer_length(buf) >= length_needed)
+	{
+//the ring is mirrored, the whole frame is contiguous from here
+		data = gsm0710_buffer_readp(buf);
+		frame->channel = ((data[0] & 252) >> 2);
+		fcs = r_crctable[fcs ^ data[0]];
+		frame->control = data[1];
+		fcs = r_crctable[fcs ^ data[1]];
+		frame->length = (data[2] & 254) >> 1;
+		fcs = r_crctable[fcs ^ data[2]];
+		header_length = 3;
+		if ((data[2] & 1) == 0)
+		{
+//frames longer than 127 bytes have a second length byte
+			header_length++;
+			length_needed++;
+			if (gsm0710_buffer_length(buf) < length_needed)
+				return 0;
+			frame->length |= data[3] << 7;
+			fcs = r_crctable[fcs ^ data[3]];
+		}
+//the FCS tells about a broken length only after it was waited for, so
+//don't wait for more than any frame size we'd agree to, an earlier run
+//taken over with -R may have chosen another than ours
+		if (frame->length > max(cmux_N1, GSM0710_MAX_N1))
+		{
+			LOG(LOG_WARNING, "Dropping frame: length %d above any frame size", frame->length);
+			buf->flag_found = 0;
+			buf->dropped_count++;
+			return gsm0710_base_buffer_get_frame(buf, frame);
+		}
+		length_needed += frame->length;
+		if (!(gsm0710_buffer_length(buf) >= length_needed))
+			return 0;
+//the payload stays where it is
+		frame->data = data + header_length;
+		if (GSM0710_FCS_DATA(frame->control))
+			for (i = 0; i < frame->length; i++)
+				fcs = r_crctable[fcs ^ frame->data[i]];
+		data = frame->data + frame->length;
+//A broken header can't tell where the frame ends, so look for the next
+//flag after its start instead of skipping what the length claims. A
+//flag in the data gives a false start, its FCS drops it.
+//check FCS
+		if (r_crctable[fcs ^ data[0]] != 0xCF)
+		{
+			LOG(LOG_WARNING, "Dropping frame: FCS doesn't match");
+			buf->flag_found = 0;
+			buf->dropped_count++;
+			return gsm0710_base_buffer_get_frame(buf, frame);
+		}
+//check end flag
+		if (data[1] != GSM0710_FRAME_FLAG)
+		{
+			LOG(LOG_WARNING, "Dropping frame: End flag not found. Instead: %d", data[1]);
+			buf->flag_found = 0;
+			buf->dropped_count++;
+			return gsm0710_base_buffer_get_frame(buf, frame);
+		}
+		buf->received_count++;
+		buf->readi += length_needed;
+		return 1;
+	}
+	return 0;
+}
+
+/* Adds the unescaped bytes from..to (exclusive) of the current advanced
+ * option frame to its running FCS. That covers address and control, and
+ * for all but UIH frames the data and the FCS itself as well.
+ */
+static void gsm0710_advanced_buffer_fcs(
+	GSM0710_Buffer * buf,
+	int from,
+	int to)
+{
+	unsigned char *data = buf->adv_data + buf->adv_start;
+	for (; from < to; from++)
+	{
+		if (from >= 2 && !GSM0710_FCS_DATA(data[1]))
+			break;
+		buf->adv_fcs = r_crctable[buf->adv_fcs ^ data[from]];
+	}
+}
+
+/* Gets a advanced option frame from buffer. The frame's payload points
+ * into the buffer's unescaped frame data, nothing is allocated. It stays
+ * valid until gsm0710_buffer_release().
+ *
+ * PARAMS:
+ * buf - the buffer, where the frame is extracted
+ * frame - gets the extracted frame
+ * RETURNS:
+ * 1 if a frame was extracted, 0 if there isn't ready frame
+ */
+static int gsm0710_advanced_buffer_get_frame(
+	GSM0710_Buffer * buf,
+	GSM0710_Frame * frame)
+{
+	LOG(LOG_DEBUG, "Enter");
+l_begin:
+//Find start flag
+	if (!buf->flag_found && gsm0710_buffer_length(buf) > 0)
+	{
+		unsigned char *data = gsm0710_buffer_readp(buf);
+		unsigned char *flag = memchr(data, GSM0710_FRAME_ADV_FLAG, gsm0710_buffer_length(buf));
+		if (flag)
+		{
+			buf->flag_found = 1;
+			buf->adv_length = 0;
+			buf->adv_found_esc = 0;
+			buf->adv_fcs = 0xFF;
+			buf->readi += flag - data + 1;
+		}
+		else
+			buf->readi = buf->writei;
+	}
+	if (!buf->flag_found)// no frame started
+		return 0;
+	if (0 == buf->adv_length)
+//skip empty frames (this causes troubles if we're using DLC 62)
+		while (gsm0710_buffer_length(buf) > 0 && (*gsm0710_buffer_readp(buf) == GSM0710_FRAME_ADV_FLAG))
+			buf->readi++;
+	while (gsm0710_buffer_length(buf) > 0)
+	{
+		int run;
+		unsigned char *p = gsm0710_buffer_readp(buf);
+		if (!buf->adv_found_esc && GSM0710_FRAME_ADV_FLAG == *p)
+		{// closing flag found, it may open the next frame as well
+			unsigned char *data = buf->adv_data + buf->adv_start;
+			int length = buf->adv_length;
+			unsigned char fcs = buf->adv_fcs;
+			buf->readi++;
+			buf->adv_length = 0;
+			buf->adv_found_esc = 0;
+			buf->adv_fcs = 0xFF;
+			if (length < 3)
+			{
+				LOG(LOG_WARNING, "Too short adv frame, length:%d", length);
+				goto l_begin;
+			}
+//the serial I/O thread hands the length over in 16 bits, don't take
+//more than any frame size we'd agree to, as for basic frames
+			if (length - 3 > max(cmux_N1, GSM0710_MAX_N1))
+			{
+				LOG(LOG_WARNING, "Dropping frame: length %d above any frame size", length - 3);
+				buf->dropped_count++;
+				goto l_begin;
+			}
+//check FCS, all but UIH frames have it folded in already
+			if ((GSM0710_FCS_DATA(data[1])
+				? fcs
+				: r_crctable[fcs ^ data[length - 1]]) != 0xCF)
+			{
+				LOG(LOG_WARNING, "Dropping frame: FCS doesn't match");
+				buf->dropped_count++;
+				goto l_begin;
+			}
+			frame->channel = ((data[0] & 252) >> 2);
+			frame->control = data[1];
+			frame->length = length - 3;
+			frame->data = data + 2;
+//keep it, the next frame goes behind
+			buf->adv_start += length;
+			buf->received_count++;
+			LOG(LOG_DEBUG, "Leave success");
+			return 1;
+		}
+		if (buf->adv_length >= buf->size || buf->adv_start + buf->adv_length >= 2 * buf->size)
+		{
+			LOG(LOG_WARNING, "Too long adv frame, length:%d", buf->adv_length);
+			buf->flag_found = 0;
+			buf->dropped_count++;
+			goto l_begin;
+		}
+		if (buf->adv_found_esc)
+		{
+			buf->adv_data[buf->adv_start + buf->adv_length] = *p ^ GSM0710_FRAME_ADV_ESC_COPML;
+			buf->adv_length++;
+			buf->adv_found_esc = 0;
+			gsm0710_advanced_buffer_fcs(buf, buf->adv_length - 1, buf->adv_length);
+		}
+		else if (GSM0710_FRAME_ADV_ESC == *p)
+			buf->adv_found_esc = 1;
+		else
+		{
+//take over whole runs up to the next flag at once, unescaping on the way
+			unsigned char *end = p + gsm0710_buffer_length(buf);
+			unsigned char *out = buf->adv_data + buf->adv_start + buf->adv_length;
+			unsigned char *out_end = buf->adv_data + 2 * buf->size;
+			unsigned char *start = p;
+			while (p < end && out < out_end)
+			{
+				run = adv_unescape_clean(p, min(end - p, out_end - out));
+				memcpy(out, p, run);
+				out += run;
+				p += run;
+				if (p + 1 >= end || *p != GSM0710_FRAME_ADV_ESC || out == out_end)
+					break;
+				*out++ = p[1] ^ GSM0710_FRAME_ADV_ESC_COPML;
+				p += 2;
+			}
+			run = out - (buf->adv_data + buf->adv_start);
+			gsm0710_advanced_buffer_fcs(buf, buf->adv_length, run);
+			buf->adv_length = run;
+			buf->readi += p - start;
+			continue;
+		}
+		buf->readi++;
+	}
+	return 0;
+}
+
+/**
+ * Asks the modem with RPN on the control channel to go on at the speed
+ * set with -S without leaving the mux-mode. The port follows when the
+ * modem agrees, a modem not knowing RPN answers NSC and the link stays
+ * at the speed of +CMUX.
+ */
+static void rpn_start(
+	Serial* serial)
+{
+	unsigned char rpn[10];
+	serial->rpn_asked = -1;
+	if (rpn_speed == 0 || rpn_speed == serial->speed)
+		return;
+	LOG(LOG_INFO, "Asking the modem to switch from %d to %d baud", serial->speed, rpn_speed);
+	rpn[0] = GSM0710_CONTROL_RPN | GSM0710_CR;
+	rpn[1] = GSM0710_EA | (8 << 1);
+	rpn[2] = GSM0710_EA | GSM0710_CR;// DLCI 0
+	rpn[3] = rpn_rate_index(rpn_speed);
+	rpn[4] = 0x03;// 8 data bits, 1 stop bit, no parity
+	rpn[5] = 0;// no flow control
+	rpn[6] = 0x11;// XON
+	rpn[7] = 0x13;// XOFF
+	rpn[8] = 0x01;// only the bit rate is to be set
+	rpn[9] = 0;
+	write_frame(0, rpn, sizeof(rpn), GSM0710_TYPE_UIH);
+	serial->rpn_asked = rpn[3];
+}
+
+/**
+ * Takes the port back to the speed it had before RPN if the modem didn't
+ * answer the TEST sent after the switch.
+ */
+static gboolean rpn_test_timeout(
+	gpointer data)
+{
+	Serial* serial = (Serial*)data;
+	serial->g_source_rpn = -1;
+	LOG(LOG_WARNING, "No answer from the modem at %d baud, going back to %d baud", serial->speed, serial->rpn_testing);
+//what went out at the new speed didn't reach the modem anyway
+	tcflush(serial->fd, TCOFLUSH);
+	if (serial_set_speed(serial, serial->rpn_testing) < 0)
+		serial->state = MUX_STATE_CLOSING;
+	serial->rpn_testing = 0;
+	return FALSE;
+}
+
+/**
+ * Switches the port to the speed agreed with RPN once what was queued
+ * before the answer went out at the old speed, through the serial I/O
+ * thread and the kernel. Frames queued since wait in the transmit queue.
+ */
+static gboolean rpn_switch_poll(
+	gpointer data)
+{
+	Serial* serial = (Serial*)data;
+	int queued = 0;
+	if (serial->rpn_old_bytes > 0 || (serial_thread.running && ring_length(&serial_thread.tx) > 0)
+		|| (ioctl(serial->fd, TIOCOUTQ, &queued) == 0 && queued > 0))
+	{
+		if (ms_since(&serial->rpn_since) < GSM0710_DRAIN_TIMEOUT)
+			return TRUE;
+		LOG(LOG_WARNING, "Serial port not written in time, switching anyway");
+		tcflush(serial->fd, TCOFLUSH);
+	}
+	serial->g_source_rpn = -1;
+	serial->rpn_switch = 0;
+	LOG(LOG_INFO, "Switching the serial port to %d baud", rpn_speed);
+	int old_speed = serial->speed;
+	if (serial_set_speed(serial, rpn_speed) < 0)
+	{
+		serial->state = MUX_STATE_CLOSING;
+		return FALSE;
+	}
+//a modem acking RPN may still not switch, the link is checked with a TEST
+	serial->rpn_testing = old_speed;
+	write_frame(0, test_channel_cmd, sizeof(test_channel_cmd), GSM0710_TYPE_UIH);
+	serial->g_source_rpn = g_timeout_add(GSM0710_RPN_TEST_TIMEOUT, rpn_test_timeout, serial);
+	tx_flush();
+	return FALSE;
+}
+
+/**
+ * Takes the answer to the RPN of rpn_start(), the port switches once
+ * everything sent before went out at the old speed.
+ *
+ * PARAMS:
+ * serial - the serial port
+ * value - the value bytes of the RPN response, NULL for an NSC
+ * length - their length
+ */
+static void rpn_answered(
+	Serial* serial,
+	const unsigned char *value,
+	int length)
+{
+	if (serial->rpn_asked < 0 || (value != NULL && (length < 2 || (value[0] >> 2) != 0)))
+		return;
+	if (value == NULL || value[1] != serial->rpn_asked || (length >= 7 && (value[6] & 0x01) == 0))
+	{
+		LOG(LOG_INFO, "The modem stays at %d baud", serial->speed);
+		serial->rpn_asked = -1;
+		return;
+	}
+	serial->rpn_asked = -1;
+	serial->rpn_switch = rpn_speed;
+	serial->rpn_old_bytes = serial->tx_queue.length - serial->tx_queue.head;
+	clock_gettime(CLOCK_MONOTONIC, &serial->rpn_since);
+	serial->g_source_rpn = g_timeout_add(GSM0710_RPN_POLL, rpn_switch_poll, serial);
+}
+
+/**
+ * Answers an RPN request of the modem with the settings of the serial
+ * port, 9600 baud for a speed RPN has no value for.
+ *
+ * PARAMS:
+ * dlci - the DLCI byte of the request
+ */
+static void rpn_current(
+	unsigned char dlci)
+{
+	unsigned char rpn[10];
+	int rate = rpn_rate_index(serial.speed);
+	rpn[0] = GSM0710_CONTROL_RPN;
+	rpn[1] = GSM0710_EA | (8 << 1);
+	rpn[2] = dlci;
+	rpn[3] = rate < 0 ? 3 : rate;
+	rpn[4] = 0x03;// 8 data bits, 1 stop bit, no parity
+	rpn[5] = 0;// no flow control
+	rpn[6] = 0x11;// XON
+	rpn[7] = 0x13;// XOFF
+	rpn[8] = 0xFF;
+	rpn[9] = 0x3F;
+	write_frame(0, rpn, sizeof(rpn), GSM0710_TYPE_UIH);
+}
+
+/*
+ * Handles commands received from the control channel.
+ */
+static int handle_command(
+	GSM0710_Frame * frame)
+{
+	LOG(LOG_DEBUG, "Enter");
+	unsigned char type, signals;
+	int length = 0, i, type_length, channel, supported = 1, answered = 0;
+	unsigned char response[2 + 127];
+//struct ussp_operation op;
+	if (frame->length > 0)
+	{
+		type = frame->data[0];// only a byte long types are handled now skip extra bytes
+		for (i = 0; (frame->length > i && (frame->data[i] & GSM0710_EA) == 0); i++);
+		i++;
+		type_length = i;
+		if ((type & GSM0710_CR) == GSM0710_CR)
+		{
+//command not ack extract frame length
+			while (frame->length > i)
+			{
+				length = (length * 128) + ((frame->data[i] & 254) >> 1);
+				if ((frame->data[i] & 1) == 1)
+					break;
+				i++;
+			}
+			i++;
+			switch ((type & ~GSM0710_CR))
+			{
+			case GSM0710_CONTROL_CLD:
+				LOG(LOG_INFO, "The mobile station requested mux-mode termination");
+				serial.state = MUX_STATE_CLOSING;				
+				break;
+			case GSM0710_CONTROL_PSC:
+				LOG(LOG_DEBUG, "Power Service Control command: ***");
+//the modem goes to sleep, wake it up with the next frame
+				serial.modem_asleep = 1;
+				LOG(LOG_DEBUG, "Frame->data = %s / frame->length = %d", frame->data + i, frame->length - i);
+			break;
+			case GSM0710_CONTROL_PN:
+				channel_negotiated(frame->data + i, min(length, frame->length - i), 1);
+				break;
+			case GSM0710_CONTROL_RPN:
+//the ptys don't care for port settings, they are acknowledged as sent
+				if (length == 1 && i < frame->length)
+				{
+					rpn_current(frame->data[i]);
+					answered = 1;
+				}
+				break;
+			case GSM0710_CONTROL_TEST:
+				LOG(LOG_DEBUG, "Test command: ");
+				LOG(LOG_DEBUG, "Frame->data = %s / frame->length = %d", frame->data + i, frame->length - i);
+				//serial->ping_number = 0;
+				break;
+			case GSM0710_CONTROL_MSC:
+				if (i + 1 < frame->length)
+				{
+					channel = ((frame->data[i] & 252) >> 2);
+					i++;
+					signals = (frame->data[i]);
+//op.op = USSP_MSC;
+//op.arg = USSP_RTS;
+//op.len = 0;
+					LOG(LOG_DEBUG, "Modem status command on channel %d", channel);
+					if (channel >= GSM0710_MAX_CHANNELS)
+						LOG(LOG_WARNING, "Modem status command for unknown channel %d", channel);
+					else if ((signals & GSM0710_SIGNAL_FC) == GSM0710_SIGNAL_FC)
+					{
+						LOG(LOG_DEBUG, "No frames allowed");
+						channellist[channel].frames_allowed = 0;
+						channel_throttle(channellist + channel, 1);
+					}
+					else
 					{
 //op.arg |= USSP_CTS;
 						LOG(LOG_DEBUG, "Frames allowed");
 						channellist[channel].frames_allowed = 1;
+						channel_throttle(channellist + channel, 0);
 					}
 					if ((signals & GSM0710_SIGNAL_RTC) == GSM0710_SIGNAL_RTC)
 					{
@@ -1355,322 +3683,1284 @@ static int handle_command(
 //op.arg |= USSP_RI;
 						LOG(LOG_DEBUG, "Signal Ring");
 					}
-					if ((signals & GSM0710_SIGNAL_DV) == GSM0710_SIGNAL_DV)
+					if ((signals & GSM0710_SIGNAL_DV) == GSM0710_SIGNAL_DV)
+					{
+//op.arg |= USSP_DCD;
+						LOG(LOG_DEBUG, "Signal DV");
+					}
+//if (channel > 0)
+//write(channellist[channel].fd, &op,
+//sizeof(op));
+				}
+				else
+					LOG(LOG_ERR, "Modem status command, but no info. i: %d, len: %d, data-len: %d",
+						i, length, frame->length);
+				break;
+			default:
+				LOG(LOG_ALERT, "Unknown command (%d) from the control channel", type);
+				i = 0;
+				response[i++] = GSM0710_CONTROL_NSC;
+				type_length &= 127; //supposes that type length is less than 128
+				response[i++] = GSM0710_EA | (type_length << 1);
+				while (type_length--)
+				{
+					response[i] = frame->data[i - 2];
+					i++;
+				}
+				write_frame(0, response, i, GSM0710_TYPE_UIH);
+				supported = 0;
+				break;
+			}
+			if (supported && !answered)
+			{
+//acknowledge the command
+				frame->data[0] = frame->data[0] & ~GSM0710_CR;
+				write_frame(0, frame->data, frame->length, GSM0710_TYPE_UIH);
+			}
+		}
+		else
+		{
+//received ack for a command
+			if (GSM0710_COMMAND_IS(type, GSM0710_CONTROL_NSC))
+			{
+				LOG(LOG_ERR, "The mobile station didn't support the command sent");
+				if (frame->length > type_length + 1 && GSM0710_COMMAND_IS(frame->data[type_length + 1], GSM0710_CONTROL_RPN))
+					rpn_answered(&serial, NULL, 0);
+			}
+			else if (GSM0710_COMMAND_IS(type, GSM0710_CONTROL_RPN) && frame->length > type_length)
+				rpn_answered(&serial, frame->data + type_length + 1, min(frame->data[type_length] >> 1, frame->length - type_length - 1));
+			else if (GSM0710_COMMAND_IS(type, GSM0710_CONTROL_PN) && frame->length > type_length)
+				channel_negotiated(frame->data + type_length + 1, min(frame->data[type_length] >> 1, frame->length - type_length - 1), 0);
+			else if (GSM0710_COMMAND_IS(type, GSM0710_CONTROL_TEST) && serial.rpn_testing)
+			{
+				LOG(LOG_INFO, "The modem answers at %d baud", serial.speed);
+				g_source_remove(serial.g_source_rpn);
+				serial.g_source_rpn = -1;
+				serial.rpn_testing = 0;
+			}
+			else
+				LOG(LOG_DEBUG, "Command acknowledged by the mobile station");
+//either way it is still in the mux-mode
+			if (serial.state == MUX_STATE_RESUMING)
+				resume_done(&serial);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Takes the next frame the serial I/O thread decoded, the payload stays
+ * in its ring until serial_thread_release().
+ *
+ * RETURNS:
+ * 1 if a frame was taken, 0 if there is none
+ */
+static int serial_thread_frame(
+	GSM0710_Frame* frame)
+{
+	GSM0710_Ring *rx = &serial_thread.rx;
+	unsigned char *p;
+	if (__atomic_load_n(&rx->head, __ATOMIC_ACQUIRE) == serial_thread.rx_next)
+		return 0;
+	p = rx->data + (serial_thread.rx_next & (rx->size - 1));
+	frame->channel = p[0];
+	frame->control = p[1];
+	frame->length = p[2] | (p[3] << 8);
+	frame->data = p + GSM0710_RING_HEADER;
+	serial_thread.rx_next += GSM0710_RING_HEADER + frame->length;
+	return 1;
+}
+
+/**
+ * Gives the frames taken with serial_thread_frame() back to the serial
+ * I/O thread, waking it if it ran out of room for more.
+ */
+static void serial_thread_release()
+{
+	__atomic_store_n(&serial_thread.rx.tail, serial_thread.rx_next, __ATOMIC_SEQ_CST);
+	if (__atomic_exchange_n(&serial_thread.rx_waiting, 0, __ATOMIC_SEQ_CST))
+		serial_thread_wake(serial_thread.wake_fd);
+}
+
+/*
+ * Extracts and handles frames from the receiver buffer, or from the
+ * serial I/O thread if there is none. PARAMS: buf - the receiver buffer
+ * or NULL
+ */
+int extract_frames(
+	GSM0710_Buffer* buf)
+{
+	LOG(LOG_DEBUG, "Enter");
+//version test for Siemens terminals to enable version 2 functions
+	int frames_extracted = 0;
+	GSM0710_Frame frame_desc;
+	GSM0710_Frame *frame = &frame_desc;
+//payloads stay in the buffer until the batch is written
+	struct iovec iov[GSM0710_RX_FRAMES];
+	unsigned char iov_channel[GSM0710_RX_FRAMES];
+	int iov_count = 0;
+	while (buf == NULL ? serial_thread_frame(frame)
+		: cmux_mode ? gsm0710_advanced_buffer_get_frame(buf, frame)
+		: gsm0710_base_buffer_get_frame(buf, frame))
+	{
+		frames_extracted++;
+		if (GSM0710_FRAME_IS_S(frame))
+		{
+			s_frame_received(frame);
+			continue;
+		}
+//the pty may take what was collected, making room for an I frame
+		if (GSM0710_FRAME_IS_I(frame) && frame->channel > 0 && frame->channel < GSM0710_MAX_CHANNELS
+			&& i_frames_in_room(channellist + frame->channel) < frame->length)
+			channel_deliver_batch(iov, iov_channel, &iov_count);
+		if (GSM0710_FRAME_IS_I(frame) && !i_frame_received(frame))
+			continue;
+		if ((GSM0710_FRAME_IS(GSM0710_TYPE_UI, frame) || GSM0710_FRAME_IS(GSM0710_TYPE_UIH, frame)
+			|| GSM0710_FRAME_IS_I(frame)) && frame->channel > 0)
+		{
+			LOG(LOG_DEBUG, "Frame is UI or UIH, channel > 0, pseudo channel");
+//data from logical channel
+			if (frame->channel < GSM0710_MAX_CHANNELS && frame->length > 0)
+			{
+				if (iov_count == GSM0710_RX_FRAMES)
+					channel_deliver_batch(iov, iov_channel, &iov_count);
+				iov[iov_count].iov_base = frame->data;
+				iov[iov_count].iov_len = frame->length;
+				serial.rx_payload += frame->length;
+				iov_channel[iov_count++] = frame->channel;
+			}
+			continue;
+		}
+//anything else may change the channels, the data received before goes first
+		channel_deliver_batch(iov, iov_channel, &iov_count);
+		if ((GSM0710_FRAME_IS(GSM0710_TYPE_UI, frame) || GSM0710_FRAME_IS(GSM0710_TYPE_UIH, frame)
+			|| GSM0710_FRAME_IS_I(frame)))
+		{
+//control channel command
+			LOG(LOG_DEBUG, "Frame channel == 0, control channel command");
+			handle_command(frame);
+		}
+		else
+		{
+//not an information frame
+			LOG(LOG_DEBUG, "Not an information frame");
+			switch ((frame->control & ~GSM0710_PF))
+			{
+			case GSM0710_TYPE_UA:
+				LOG(LOG_DEBUG, "Frame is UA");
+				if (channellist[frame->channel].opened)
+				{
+					LOG(LOG_INFO, "Logical channel %d for %s closed",
+						frame->channel, channellist[frame->channel].origin);
+					channel_close_done(channellist+frame->channel);
+				}
+				else
+				{
+					channellist[frame->channel].opened = 1;
+					if (frame->channel == 0)
+					{
+						LOG(LOG_DEBUG, "Control channel opened");
+						cache_save(&serial);
+						rpn_start(&serial);
+						//send version Siemens version test
+						//static unsigned char version_test[] = "\x23\x21\x04TEMUXVERSION2\0";
+						//write_frame(0, version_test, sizeof(version_test), GSM0710_TYPE_UIH);
+					}
+					else
+					{
+						LOG(LOG_INFO, "Logical channel %d opened", frame->channel);
+						boot_mark(&serial, &serial.boot_first_channel, "first channel");
+						channel_alloc_reply(channellist+frame->channel, NULL);
+					}
+				}
+				break;
+			case GSM0710_TYPE_DM:
+				if (channellist[frame->channel].opened)
+				{
+					LOG(LOG_INFO, "DM received, so the channel %d for %s was already closed",
+						frame->channel, channellist[frame->channel].origin);
+//no DISC handshake, the modem closed it already
+					channellist[frame->channel].opened = 0;
+					SYSCHECK(logical_channel_close(channellist+frame->channel));
+				}
+				else
+				{
+					if (frame->channel == 0)
+					{
+						LOG(LOG_INFO, "Couldn't open control channel.\n->Terminating");
+						cache_forget(&serial);
+						serial.state = MUX_STATE_CLOSING;				
+//close channels
+					}
+					else
 					{
-//op.arg |= USSP_DCD;
-						LOG(LOG_DEBUG, "Signal DV");
+						LOG(LOG_INFO, "Logical channel %d for %s couldn't be opened", frame->channel, channellist[frame->channel].origin);
+						if (channellist[frame->channel].alloc_context != NULL)
+						{
+							channel_alloc_reply(channellist+frame->channel, "The modem refused the channel");
+							SYSCHECK(logical_channel_close(channellist+frame->channel));
+						}
 					}
-//if (channel > 0)
-//write(channellist[channel].fd, &op,
-//sizeof(op));
 				}
-				else
-					LOG(LOG_ERR, "Modem status command, but no info. i: %d, len: %d, data-len: %d",
-						i, length, frame->length);
 				break;
-			default:
-				LOG(LOG_ALERT, "Unknown command (%d) from the control channel", type);
-				if ((response = malloc(sizeof(char) * (2 + type_length))) != NULL)
+			case GSM0710_TYPE_DISC:
+				if (channellist[frame->channel].opened)
 				{
-					i = 0;
-					response[i++] = GSM0710_CONTROL_NSC;
-					type_length &= 127; //supposes that type length is less than 128
-					response[i++] = GSM0710_EA | (type_length << 1);
-					while (type_length--)
+					channellist[frame->channel].opened = 0;
+					write_frame(frame->channel, NULL, 0, GSM0710_TYPE_UA | GSM0710_PF);
+					if (frame->channel == 0)
 					{
-						response[i] = frame->data[i - 2];
-						i++;
+						serial.state = MUX_STATE_CLOSING;				
+						LOG(LOG_INFO, "Control channel closed");
 					}
-					write_frame(0, response, i, GSM0710_TYPE_UIH);
-					free(response);
-					supported = 0;
+					else
+						LOG(LOG_INFO, "Logical channel %d for %s closed", frame->channel, channellist[frame->channel].origin);
+//both sides closed it at once
+					if (channellist[frame->channel].closing)
+						channel_close_done(channellist+frame->channel);
+				}
+				else
+				{
+//channel already closed
+					LOG(LOG_WARNING, "Received DISC even though channel %d for %s was already closed",
+							frame->channel, channellist[frame->channel].origin);
+					write_frame(frame->channel, NULL, 0, GSM0710_TYPE_DM | GSM0710_PF);
+				}
+				break;
+			case GSM0710_TYPE_SABM:
+//channel open request
+				if (channellist[frame->channel].opened)
+				{
+					if (frame->channel == 0)
+						LOG(LOG_INFO, "Control channel opened");
+					else
+						LOG(LOG_INFO, "Logical channel %d for %s opened",
+							frame->channel, channellist[frame->channel].origin);
 				}
 				else
-					LOG(LOG_ALERT, "Out of memory, when allocating space for response");
+//channel already opened
+					LOG(LOG_WARNING, "Received SABM even though channel %d for %s was already closed",
+						frame->channel, channellist[frame->channel].origin);
+				channellist[frame->channel].opened = 1;
+				write_frame(frame->channel, NULL, 0, GSM0710_TYPE_UA | GSM0710_PF);
 				break;
 			}
-			if (supported)
+		}
+	}
+	channel_deliver_batch(iov, iov_channel, &iov_count);
+	i_frames_ack();
+	if (buf == NULL)
+		serial_thread_release();
+	else
+		gsm0710_buffer_release(buf);
+	LOG(LOG_DEBUG, "Leave");
+	return frames_extracted;
+}
+
+/**
+ * Function responsible by all signal handlers treatment
+ * any new signal must be added here
+ */
+void signal_treatment(
+	int param)
+{
+	switch (param)
+	{
+	case SIGPIPE:
+		exit(0);
+	break;
+	case SIGHUP:
+//reread the configuration files
+	break;
+	case SIGINT:
+	case SIGTERM:
+	case SIGUSR1:
+		//exit(0);
+//sig_term(param);
+//poll() returns with EINTR and the main loop looks at the flag again,
+//nothing else is safe to call here
+		main_running = 0;
+	break;
+	case SIGKILL:
+	default:
+		exit(0);
+	break;
+	}
+}
+
+static int modem_hw_(const char* pm_base_dir, const char* entry, int on)
+{
+	LOG(LOG_DEBUG, "Enter");
+	if (pm_base_dir != NULL)
+	{
+		char fn[256];
+		SYSCHECK(snprintf(fn, sizeof(fn), "%s/%s", pm_base_dir, entry));
+		LOG(LOG_DEBUG, "echo %c > %s", on?'1':'0', fn);
+		int fd;
+		SYSCHECK(fd = open(fn, O_RDWR | O_NONBLOCK));
+		SYSCHECK(write(fd, on?"1\n":"0\n", 2));
+		SYSCHECK(close(fd));
+	}
+	else
+		LOG(LOG_DEBUG, "no pm_base_dir");
+	LOG(LOG_DEBUG, "Leave");
+	return 0;
+}
+
+static int modem_hw_off(const char* pm_base_dir)
+{
+	LOG(LOG_DEBUG, "Enter");
+	SYSCHECK(modem_hw_(pm_base_dir, "power_on", 0));
+	SYSCHECK(modem_hw_(pm_base_dir, "reset", 0));
+	LOG(LOG_DEBUG, "Leave");
+	return 0;
+}
+
+gboolean serial_device_read(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	Serial* serial = (Serial*)data;
+	LOG(LOG_DEBUG, "Enter");
+	if (condition == G_IO_IN)
+	{
+		switch (serial->state)
+		{
+		case MUX_STATE_RESUMING:
+		case MUX_STATE_MUXING:
+		{
+			int len;
+			//input from serial port, straight into the ring, until a short
+			//read tells the port is drained
+			LOG(LOG_DEBUG, "Serial Data");
+			int length;
+			ALLOC_CHECK_ENTER();
+			do
 			{
-//acknowledge the command
-				frame->data[0] = frame->data[0] & ~GSM0710_CR;
-				write_frame(0, frame->data, frame->length, GSM0710_TYPE_UIH);
+				if ((length = gsm0710_buffer_free(serial->in_buf)) <= 0
+				|| (len = read(serial->fd, gsm0710_buffer_writep(serial->in_buf), length)) <= 0)
+					break;
+				syslogdump("<s ", gsm0710_buffer_writep(serial->in_buf), len);
+				serial->in_buf->writei += len;
+				serial->rx_bytes += len;
+//the modem talks, so it is awake
+				link_touch(serial);
+				serial->modem_asleep = 0;
+				//extract and handle ready frames
+				if (extract_frames(serial->in_buf) > 0)
+				{
+					time(&serial->frame_receive_time); //get the current time
+					serial->ping_number = 0;
+				}
 			}
+			while (len == length && (serial->state == MUX_STATE_MUXING || serial->state == MUX_STATE_RESUMING));
+			ALLOC_CHECK_LEAVE();
+			LOG(LOG_DEBUG, "Leave keep watching");
+			return TRUE;
 		}
-		else
+		break;
+		default:
+			LOG(LOG_WARNING, "Don't know how to handle reading in state %d", serial->state);
+		break;
+		}
+	}
+	else if (condition == G_IO_HUP)
+	{
+		LOG(LOG_WARNING, "hup on serial file, closing");
+		serial->state = MUX_STATE_CLOSING;				
+	}
+	LOG(LOG_DEBUG, "Leave stop watching");
+	return FALSE;
+}
+
+gboolean serial_device_write(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	LOG(LOG_DEBUG, "Enter");
+	if (tx_flush() > 0)
+	{
+		LOG(LOG_DEBUG, "Leave keep watching");
+		return TRUE;
+	}
+//tx_flush() removed the watch already
+	LOG(LOG_DEBUG, "Leave queue written");
+	return FALSE;
+}
+
+static void serial_thread_decode(Serial* serial);
+
+/**
+ * Reads the serial port into the receive buffer until a short read
+ * tells it is drained or the buffer is full, moving the frames to the
+ * main loop in between. Runs in the serial I/O thread.
+ */
+static void serial_thread_read(
+	Serial* serial)
+{
+	GSM0710_Buffer *buf = serial->in_buf;
+	int length, len;
+	do
+	{
+		if ((length = gsm0710_buffer_free(buf)) <= 0
+		|| (len = read(serial->fd, gsm0710_buffer_writep(buf), length)) <= 0)
+			break;
+		syslogdump("<s ", gsm0710_buffer_writep(buf), len);
+		buf->writei += len;
+		__atomic_fetch_add(&serial->rx_bytes, len, __ATOMIC_RELAXED);
+		link_touch(serial);
+		serial_thread_decode(serial);
+	}
+	while (len == length);
+}
+
+/**
+ * Decodes the frames in the receive buffer into the ring of the main
+ * loop and notifies it. Stops while the ring hasn't room for a frame of
+ * any size, the main loop wakes the thread when it made some. Runs in
+ * the serial I/O thread.
+ */
+static void serial_thread_decode(
+	Serial* serial)
+{
+	GSM0710_Buffer *buf = serial->in_buf;
+	GSM0710_Ring *rx = &serial_thread.rx;
+	GSM0710_Frame frame;
+	unsigned char *p;
+	int frames = 0;
+	for (;;)
+	{
+		if (rx->size - ring_length(rx) < GSM0710_RING_HEADER + buf->size)
 		{
-//received ack for a command
-			if (GSM0710_COMMAND_IS(type, GSM0710_CONTROL_NSC))
-				LOG(LOG_ERR, "The mobile station didn't support the command sent");
-			else
-				LOG(LOG_DEBUG, "Command acknowledged by the mobile station");
+//ask first, then look again, so the main loop can't miss the request
+			__atomic_store_n(&serial_thread.rx_waiting, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			if (rx->size - ring_length(rx) < GSM0710_RING_HEADER + buf->size)
+			{
+				serial_thread.rx_full++;
+				break;
+			}
+			__atomic_store_n(&serial_thread.rx_waiting, 0, __ATOMIC_RELAXED);
+		}
+		if (!(cmux_mode
+			? gsm0710_advanced_buffer_get_frame(buf, &frame)
+			: gsm0710_base_buffer_get_frame(buf, &frame)))
+			break;
+		p = rx->data + (rx->head & (rx->size - 1));
+		p[0] = frame.channel;
+		p[1] = frame.control;
+		p[2] = frame.length & 0xFF;
+		p[3] = frame.length >> 8;
+		memcpy(p + GSM0710_RING_HEADER, frame.data, frame.length);
+		__atomic_store_n(&rx->head, rx->head + GSM0710_RING_HEADER + frame.length, __ATOMIC_RELEASE);
+		frames++;
+	}
+	gsm0710_buffer_release(buf);
+	if (frames > 0)
+		serial_thread_wake(serial_thread.notify_fd);
+}
+
+/**
+ * Writes what the main loop handed over to the serial port, as much as
+ * it takes without blocking. Notifies the main loop if it waits for
+ * room. Runs in the serial I/O thread.
+ *
+ * RETURNS:
+ * number of bytes still to be written
+ */
+static int serial_thread_write(
+	Serial* serial)
+{
+	GSM0710_Ring *tx = &serial_thread.tx;
+	unsigned int length;
+	int c;
+	while ((length = ring_length(tx)) > 0)
+	{
+		c = write(serial->fd, tx->data + (tx->tail & (tx->size - 1)), length);
+		serial_thread.syscalls++;
+		if (c < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		if (c < 0)
+		{
+			LOG(LOG_WARNING, "Couldn't write to the serial port, dropping %u bytes: '%s' (code: %d)",
+				length, strerror(errno), errno);
+			c = length;
+		}
+		__atomic_store_n(&tx->tail, tx->tail + c, __ATOMIC_SEQ_CST);
+	}
+	if (__atomic_exchange_n(&serial_thread.tx_waiting, 0, __ATOMIC_SEQ_CST))
+		serial_thread_wake(serial_thread.notify_fd);
+	return length;
+}
+
+/**
+ * The serial I/O thread, it polls only the serial port and its eventfd.
+ * Before it ends it writes what the main loop handed over.
+ */
+static void *serial_thread_run(
+	void *data)
+{
+	Serial* serial = (Serial*)data;
+	struct pollfd pfd[2];
+	struct timespec woken, done;
+	uint64_t events;
+	long busy;
+	while (!__atomic_load_n(&serial_thread.stop, __ATOMIC_ACQUIRE))
+	{
+		pfd[0].fd = serial->fd;
+		pfd[0].events = (gsm0710_buffer_free(serial->in_buf) > 0 ? POLLIN : 0)
+			| (ring_length(&serial_thread.tx) > 0 ? POLLOUT : 0);
+		pfd[1].fd = serial_thread.wake_fd;
+		pfd[1].events = POLLIN;
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG(LOG_ERR, "system-error: '%s' (code: %d)", strerror(errno), errno);
+			pfd[0].revents = POLLERR;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &woken);
+		__atomic_fetch_add(&serial_thread.wakeups, 1, __ATOMIC_RELAXED);
+		if ((pfd[1].revents & POLLIN) && read(serial_thread.wake_fd, &events, sizeof(events)) < 0)
+			LOG(LOG_WARNING, "Couldn't read the eventfd: '%s' (code: %d)", strerror(errno), errno);
+		if (pfd[0].revents & (POLLHUP | POLLERR | POLLNVAL))
+		{
+			__atomic_store_n(&serial_thread.hangup, 1, __ATOMIC_RELEASE);
+			serial_thread_wake(serial_thread.notify_fd);
+			return NULL;
+		}
+		if (pfd[0].revents & POLLIN)
+			serial_thread_read(serial);
+//the main loop may have made room for the frames still buffered
+		serial_thread_decode(serial);
+		serial_thread_write(serial);
+		clock_gettime(CLOCK_MONOTONIC, &done);
+		busy = (done.tv_sec - woken.tv_sec) * 1000000 + (done.tv_nsec - woken.tv_nsec) / 1000;
+		if (busy > serial_thread.busy_max)
+			serial_thread.busy_max = busy;
+	}
+	while (serial_thread_write(serial) > 0)
+	{
+		pfd[0].fd = serial->fd;
+		pfd[0].events = POLLOUT;
+		if (poll(pfd, 1, GSM0710_DRAIN_TIMEOUT) <= 0)
+		{
+			LOG(LOG_WARNING, "Serial port not writable, %u bytes dropped", ring_length(&serial_thread.tx));
+			break;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Called by the main loop when the serial I/O thread decoded frames,
+ * made room for more or lost the serial port.
+ */
+static gboolean serial_thread_receive(
+	GIOChannel *source,
+	GIOCondition condition,
+	gpointer data)
+{
+	Serial* serial = (Serial*)data;
+	uint64_t events;
+	LOG(LOG_DEBUG, "Enter");
+	if (read(serial_thread.notify_fd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+		LOG(LOG_WARNING, "Couldn't read the eventfd: '%s' (code: %d)", strerror(errno), errno);
+	if (__atomic_load_n(&serial_thread.hangup, __ATOMIC_ACQUIRE))
+	{
+		LOG(LOG_WARNING, "hup on serial file, closing");
+		serial->state = MUX_STATE_CLOSING;
+		LOG(LOG_DEBUG, "Leave stop watching");
+		return FALSE;
+	}
+	if (serial->state == MUX_STATE_MUXING || serial->state == MUX_STATE_RESUMING)
+	{
+		ALLOC_CHECK_ENTER();
+		if (extract_frames(NULL) > 0)
+		{
+			time(&serial->frame_receive_time); //get the current time
+			serial->ping_number = 0;
+//the modem talks, so it is awake
+			serial->modem_asleep = 0;
 		}
+		ALLOC_CHECK_LEAVE();
+	}
+//the thread may have made room for the transmit queue
+	tx_flush();
+	LOG(LOG_DEBUG, "Leave keep watching");
+	return TRUE;
+}
+
+/**
+ * Frees what serial_thread_start() set up, the thread has to be gone.
+ */
+static void serial_thread_free()
+{
+	if (serial_thread.notify_channel != NULL)
+		g_io_channel_unref(serial_thread.notify_channel);
+	serial_thread.notify_channel = NULL;
+	if (serial_thread.wake_fd >= 0)
+		close(serial_thread.wake_fd);
+	if (serial_thread.notify_fd >= 0)
+		close(serial_thread.notify_fd);
+	serial_thread.wake_fd = serial_thread.notify_fd = -1;
+	ring_destroy(&serial_thread.tx);
+	ring_destroy(&serial_thread.rx);
+}
+
+/**
+ * Hands the serial port to a thread of its own, the main loop watches
+ * its notifications with serial->g_source instead. The rings are sized
+ * like the transmit queue and for a few receive buffers full of frames.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+static int serial_thread_start(
+	Serial* serial)
+{
+	sigset_t all, old;
+	memset(&serial_thread, 0, sizeof(serial_thread));
+	serial_thread.wake_fd = serial_thread.notify_fd = -1;
+	if (ring_init(&serial_thread.tx, serial->tx_queue.size) < 0
+		|| ring_init(&serial_thread.rx, 4 * (GSM0710_RING_HEADER + serial->in_buf->size)) < 0
+		|| (serial_thread.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+		|| (serial_thread.notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+	{
+		LOG(LOG_ERR, "system-error: '%s' (code: %d)", strerror(errno), errno);
+		serial_thread_free();
+		return -1;
+	}
+	serial_thread.notify_channel = g_io_channel_unix_new(serial_thread.notify_fd);
+//signals stay with the main loop
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	errno = pthread_create(&serial_thread.thread, NULL, serial_thread_run, serial);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (errno != 0)
+	{
+		LOG(LOG_ERR, "system-error: '%s' (code: %d)", strerror(errno), errno);
+		serial_thread_free();
+		return -1;
 	}
+	serial_thread.running = 1;
+	serial->g_source = mux_watch_add(serial_thread.notify_channel, G_IO_IN, serial_thread_receive, serial);
+	LOG(LOG_INFO, "Serial I/O thread started");
 	return 0;
 }
 
-/*
- * Extracts and handles frames from the receiver buffer. PARAMS: buf
- * - the receiver buffer
+/**
+ * Ends the serial I/O thread after it wrote what it was handed, the
+ * main loop owns the serial port again. Its watch has to be removed
+ * already.
+ */
+static void serial_thread_stop()
+{
+	if (!serial_thread.running)
+		return;
+	__atomic_store_n(&serial_thread.stop, 1, __ATOMIC_RELEASE);
+	serial_thread_wake(serial_thread.wake_fd);
+	pthread_join(serial_thread.thread, NULL);
+	serial_thread.running = 0;
+	serial.tx_syscalls += serial_thread.syscalls;
+	if (ring_length(&serial_thread.rx) > 0)
+		LOG(LOG_INFO, "Dropping %u bytes of frames not handled yet", ring_length(&serial_thread.rx));
+	LOG(LOG_INFO, "The serial I/O thread woke %lu times, was busy for %ld us at most and waited %lu times for the main loop",
+		serial_thread.wakeups, serial_thread.busy_max, serial_thread.rx_full);
+	serial_thread_free();
+}
+
+/**
+ * Tells if a line from the modem is a final result code.
+ */
+static AtResults at_result_code(
+	const char *line)
+{
+	static const char *errors[] = { "ERROR", "+CME ERROR", "+CMS ERROR",
+		"NO CARRIER", "BUSY", "NO ANSWER", "NO DIALTONE", };
+	int i;
+	if (strcmp(line, "OK") == 0 || strncmp(line, "CONNECT", 7) == 0)
+		return AT_RESULT_OK;
+	for (i = 0; i < sizeof(errors) / sizeof(*errors); i++)
+		if (strncmp(line, errors[i], strlen(errors[i])) == 0)
+			return AT_RESULT_ERROR;
+	return AT_RESULT_NONE;
+}
+
+/**
+ * Reads what the modem answers to AT commands and splits it into lines,
+ * no matter how it is spread over the reads. Only printable characters
+ * are kept, so garbage some modems send before the first OK doesn't hide
+ * it.
  */
-int extract_frames(
-	GSM0710_Buffer* buf)
+static gboolean at_read(
+	GIOChannel *source,
+	GIOCondition condition,
+	gpointer data)
 {
+	Serial* serial = (Serial*)data;
+	AtEngine* at = &serial->at;
+	unsigned char buf[256];
+	int len, i;
+	AtResults result;
 	LOG(LOG_DEBUG, "Enter");
-//version test for Siemens terminals to enable version 2 functions
-	int frames_extracted = 0;
-	GSM0710_Frame *frame;
-	while ((frame = cmux_mode
-		? gsm0710_advanced_buffer_get_frame(buf)
-		: gsm0710_base_buffer_get_frame(buf)))
+	while (at->result != NULL && (len = read(serial->fd, buf, sizeof(buf))) > 0)
 	{
-		frames_extracted++;
-		if ((GSM0710_FRAME_IS(GSM0710_TYPE_UI, frame) || GSM0710_FRAME_IS(GSM0710_TYPE_UIH, frame)))
+		syslogdump("<s ", buf, len);
+		at->discard = 0;
+		for (i = 0; i < len && at->result != NULL && !at->discard; i++)
 		{
-			LOG(LOG_DEBUG, "Frame is UI or UIH");
-			if (frame->channel > 0)
+			if (buf[i] != '\r' && buf[i] != '\n')
 			{
-				gsize written;
-				LOG(LOG_DEBUG, "Frame channel > 0, pseudo channel");
-//data from logical channel
-				g_io_channel_write_chars(channellist[frame->channel].g_channel, (gchar*)frame->data, (gssize)frame->length, &written, NULL);
-				if (written != frame->length)
-					LOG(LOG_WARNING, "Pty write buffer overflow, data loss: needed to write %d bytes, written %d, channel %d", frame->length, written, frame->channel);
-				else
-					LOG(LOG_DEBUG, "Written %d bytes to pty channel %d", written, frame->channel);
-				g_io_channel_flush(channellist[frame->channel].g_channel, NULL );
+				if (buf[i] >= 0x20 && buf[i] < 0x7f && at->line_length < sizeof(at->line) - 1)
+					at->line[at->line_length++] = buf[i];
+				continue;
+			}
+			if (at->line_length == 0)
+				continue;
+			at->line[at->line_length] = '\0';
+			at->line_length = 0;
+			if ((result = at_result_code(at->line)) == AT_RESULT_NONE)
+			{
+				LOG(LOG_DEBUG, "Modem says '%s'", at->line);
+				if (at->response != NULL)
+					at->response(serial, at->line);
 			}
 			else
 			{
-//control channel command
-				LOG(LOG_DEBUG, "Frame channel == 0, control channel command");
-				handle_command(frame);
+				LOG(LOG_DEBUG, "Received '%s'", at->line);
+				at->result(serial, result);
 			}
 		}
+	}
+//whoever set result to NULL removed the watch already
+	return at->result != NULL;
+}
+
+/**
+ * Starts reading the answers of the modem, result() gets the final
+ * result codes.
+ */
+static void at_watch(
+	Serial* serial,
+	void (*result)(struct Serial* serial, AtResults result))
+{
+	serial->at.result = result;
+	serial->at.response = NULL;
+	serial->at.line_length = 0;
+	if (serial->g_channel == NULL)
+		serial->g_channel = g_io_channel_unix_new(serial->fd);
+	if (serial->g_source_probe == (guint)-1)
+		serial->g_source_probe = mux_watch_add(serial->g_channel, G_IO_IN, at_read, serial);
+}
+
+/**
+ * Stops reading the answers of the modem.
+ */
+static void at_stop(
+	Serial* serial)
+{
+	serial->at.result = NULL;
+	if (serial->g_source_probe != (guint)-1)
+		mux_watch_remove(serial->g_source_probe);
+	serial->g_source_probe = -1;
+}
+
+/**
+ * Writes a command of the script to the modem.
+ */
+static void at_write(
+	const AtCommand *command)
+{
+	char line[GSM0710_NAME_SIZE + 2];
+	int length = snprintf(line, sizeof(line), "%s\r\n", command->text);
+	syslogdump(">s ", (unsigned char *) line, length);
+	if (write(serial.fd, line, length) != length)
+		LOG(LOG_WARNING, "Couldn't write '%s' to the serial port: '%s' (code: %d)", command->text, strerror(errno), errno);
+}
+
+static gboolean at_timeout(
+	gpointer data);
+static void at_finish(
+	Serial* serial,
+	int result);
+
+/**
+ * Sends the next command of the script, and those after it which may
+ * go without waiting for an answer. Arms the timeout of the oldest
+ * command not answered.
+ */
+static void at_send(
+	Serial* serial)
+{
+	AtEngine* at = &serial->at;
+	while (at->sent < at->count && (at->sent == at->answered
+		|| (at_pipeline && (at->script[at->sent].flags & AT_PIPELINE))))
+		at_write(&at->script[at->sent++]);
+	if (serial->g_source_boot == (guint)-1)
+		serial->g_source_boot = g_timeout_add(at->script[at->answered].timeout, at_timeout, serial);
+}
+
+/**
+ * Ends the script, done() is told the result.
+ */
+static void at_finish(
+	Serial* serial,
+	int result)
+{
+	if (serial->g_source_boot != (guint)-1)
+		g_source_remove(serial->g_source_boot);
+	serial->g_source_boot = -1;
+	at_stop(serial);
+	serial->at.done(serial, result);
+}
+
+/**
+ * Handles the final result code of the oldest command not answered.
+ */
+static void at_script_result(
+	Serial* serial,
+	AtResults result)
+{
+	AtEngine* at = &serial->at;
+	AtCommand* command = &at->script[at->answered];
+	if (result != AT_RESULT_TIMEOUT && serial->g_source_boot != (guint)-1)
+		g_source_remove(serial->g_source_boot);
+	serial->g_source_boot = -1;
+	if (result == AT_RESULT_OK || (command->flags & AT_MAY_FAIL))
+	{
+		if (++at->answered == at->count)
+			at_finish(serial, 0);
 		else
+			at_send(serial);
+		return;
+	}
+	if (command->flags & AT_LEAVE_MUX)
+	{
+		LOG(LOG_WARNING, "Modem does not respond to AT commands, trying close mux mode");
+		//if (cmux_mode) we do not know now so write both
+			write_frame(0, NULL, 0, GSM0710_CONTROL_CLD | GSM0710_CR);
+		//else
+			write_frame(0, close_channel_cmd, 2, GSM0710_TYPE_UIH);
+		tx_drain(GSM0710_DRAIN_TIMEOUT);
+		command->flags &= ~AT_LEAVE_MUX;
+		at->sent = at->answered;
+		at_send(serial);
+		return;
+	}
+	LOG(LOG_WARNING, "Modem answered '%s' with %s", command->text,
+		result == AT_RESULT_TIMEOUT ? "nothing" : "an error");
+	at_finish(serial, -1);
+}
+
+static gboolean at_timeout(
+	gpointer data)
+{
+	Serial* serial = (Serial*)data;
+	serial->g_source_boot = -1;
+	at_script_result(serial, AT_RESULT_TIMEOUT);
+	return FALSE;
+}
+
+/**
+ * Hands a line which isn't a result code to the oldest command not
+ * answered, the modem answers in order.
+ */
+static void at_script_response(
+	Serial* serial,
+	const char *line)
+{
+	AtEngine* at = &serial->at;
+	if (at->answered < at->sent && at->script[at->answered].response != NULL)
+		at->script[at->answered].response(serial, line);
+}
+
+/**
+ * Empties the script.
+ */
+static void at_script_start(
+	Serial* serial)
+{
+	serial->at.count = serial->at.sent = serial->at.answered = 0;
+}
+
+/**
+ * Appends a command to the script.
+ *
+ * PARAMS:
+ * serial - the serial port
+ * text - the command without the line end
+ * timeout - ms to wait for its answer
+ * flags - AT_MAY_FAIL, AT_LEAVE_MUX, AT_PIPELINE
+ * RETURNS:
+ * the command, NULL if the script is full
+ */
+static AtCommand* at_add(
+	Serial* serial,
+	const char *text,
+	int timeout,
+	int flags)
+{
+	AtCommand* command;
+	if (serial->at.count == GSM0710_AT_SCRIPT)
+	{
+		LOG(LOG_WARNING, "AT script full, dropping '%s'", text);
+		return NULL;
+	}
+	command = &serial->at.script[serial->at.count++];
+	snprintf(command->text, sizeof(command->text), "%s", text);
+	command->timeout = timeout;
+	command->flags = flags;
+	command->response = NULL;
+	return command;
+}
+
+/**
+ * Runs the script from the main loop. What the modem sent before is
+ * dropped, done() is called when the last command was answered or one
+ * failed.
+ */
+static void at_run(
+	Serial* serial,
+	void (*done)(struct Serial* serial, int result))
+{
+	serial->at.done = done;
+	at_watch(serial, at_script_result);
+	serial->at.response = at_script_response;
+	tcflush(serial->fd, TCIFLUSH);
+	serial->at.discard = 1;
+	at_send(serial);
+}
+
+/**
+ * Stops the power sequence and the mux-mode start, for closing.
+ */
+static void power_sequence_stop(
+	Serial* serial)
+{
+	if (serial->g_source_boot != (guint)-1)
+		g_source_remove(serial->g_source_boot);
+	serial->g_source_boot = -1;
+	at_stop(serial);
+}
+
+/**
+ * The modem's first OK to the probes ends the power sequence, the AT
+ * commands follow right away.
+ */
+static void power_probe_result(
+	Serial* serial,
+	AtResults result)
+{
+	if (result != AT_RESULT_OK)
+		return;
+	boot_mark(serial, &serial->boot_first_at, "first AT answer");
+	if (serial->g_source_boot != (guint)-1)
+		g_source_remove(serial->g_source_boot);
+	serial->g_source_boot = -1;
+	serial->state = MUX_STATE_INITILIZING;
+	watchdog(serial);
+}
+
+/**
+ * Steps through the power sequence of the modem with the delays of the
+ * profile, then sends AT with a backoff until the modem answers or
+ * boot_timeout passed.
+ */
+static gboolean power_sequence(
+	gpointer data)
+{
+	Serial* serial = (Serial*)data;
+	static const char probe[] = "AT\r\n";
+	int delay;
+	LOG(LOG_DEBUG, "Enter");
+	switch (serial->boot_step++)
+	{
+//the modem may still answer the probes, so a failure is only logged
+	case 0:
+		if (modem_hw_(serial->pm_base_dir, "power_on", 1) < 0)
+			LOG(LOG_WARNING, "Couldn't switch the modem on");
+		delay = modem_profile.power_delay;
+		break;
+	case 1:
+		if (modem_hw_(serial->pm_base_dir, "reset", 1) < 0)
+			LOG(LOG_WARNING, "Couldn't assert the modem reset");
+		delay = modem_profile.reset_pulse;
+		break;
+	case 2:
+		if (modem_hw_(serial->pm_base_dir, "reset", 0) < 0)
+			LOG(LOG_WARNING, "Couldn't release the modem reset");
+		delay = 0;
+		break;
+	case 3:
+//what came during the power sequence is noise
+		tcflush(serial->fd, TCIFLUSH);
+		at_watch(serial, power_probe_result);
+		serial->probe_delay = modem_profile.probe_first;
+//fall through, the first probe goes right away
+	default:
+		if (ms_since(&serial->boot_started) > modem_profile.boot_timeout)
 		{
-//not an information frame
-			LOG(LOG_DEBUG, "Not an information frame");
-			switch ((frame->control & ~GSM0710_PF))
-			{
-			case GSM0710_TYPE_UA:
-				LOG(LOG_DEBUG, "Frame is UA");
-				if (channellist[frame->channel].opened)
-				{
-					LOG(LOG_INFO, "Logical channel %d for %s closed",
-						frame->channel, channellist[frame->channel].origin);
-					channellist[frame->channel].opened = 0;
-				}
-				else
-				{
-					channellist[frame->channel].opened = 1;
-					if (frame->channel == 0)
-					{
-						LOG(LOG_DEBUG, "Control channel opened");
-						//send version Siemens version test
-						//static unsigned char version_test[] = "\x23\x21\x04TEMUXVERSION2\0";
-						//write_frame(0, version_test, sizeof(version_test), GSM0710_TYPE_UIH);
-					}
-					else
-						LOG(LOG_INFO, "Logical channel %d opened", frame->channel);
-				}
-				break;
-			case GSM0710_TYPE_DM:
-				if (channellist[frame->channel].opened)
-				{
-					SYSCHECK(logical_channel_close(channellist+frame->channel));
-					LOG(LOG_INFO, "DM received, so the channel %d for %s was already closed",
-						frame->channel, channellist[frame->channel].origin);
-				}
-				else
-				{
-					if (frame->channel == 0)
-					{
-						LOG(LOG_INFO, "Couldn't open control channel.\n->Terminating");
-						serial.state = MUX_STATE_CLOSING;				
-//close channels
-					}
-					else
-						LOG(LOG_INFO, "Logical channel %d for %s couldn't be opened", frame->channel, channellist[frame->channel].origin);
-				}
-				break;
-			case GSM0710_TYPE_DISC:
-				if (channellist[frame->channel].opened)
-				{
-					channellist[frame->channel].opened = 0;
-					write_frame(frame->channel, NULL, 0, GSM0710_TYPE_UA | GSM0710_PF);
-					if (frame->channel == 0)
-					{
-						serial.state = MUX_STATE_CLOSING;				
-						LOG(LOG_INFO, "Control channel closed");
-					}
-					else
-						LOG(LOG_INFO, "Logical channel %d for %s closed", frame->channel, channellist[frame->channel].origin);
-				}
-				else
-				{
-//channel already closed
-					LOG(LOG_WARNING, "Received DISC even though channel %d for %s was already closed",
-							frame->channel, channellist[frame->channel].origin);
-					write_frame(frame->channel, NULL, 0, GSM0710_TYPE_DM | GSM0710_PF);
-				}
-				break;
-			case GSM0710_TYPE_SABM:
-//channel open request
-				if (channellist[frame->channel].opened)
-				{
-					if (frame->channel == 0)
-						LOG(LOG_INFO, "Control channel opened");
-					else
-						LOG(LOG_INFO, "Logical channel %d for %s opened",
-							frame->channel, channellist[frame->channel].origin);
-				}
-				else
-//channel already opened
-					LOG(LOG_WARNING, "Received SABM even though channel %d for %s was already closed",
-						frame->channel, channellist[frame->channel].origin);
-				channellist[frame->channel].opened = 1;
-				write_frame(frame->channel, NULL, 0, GSM0710_TYPE_UA | GSM0710_PF);
-				break;
-			}
+			LOG(LOG_WARNING, "Modem doesn't answer after %d ms, power cycling", modem_profile.boot_timeout);
+			serial->g_source_boot = -1;
+			serial->state = MUX_STATE_CLOSING;
+			return FALSE;
 		}
-		destroy_frame(frame);
+		syslogdump(">s ", (const unsigned char *)probe, strlen(probe));
+		if (write(serial->fd, probe, strlen(probe)) < 0 && errno != EAGAIN)
+			LOG(LOG_WARNING, "Couldn't write to the serial port: '%s' (code: %d)", strerror(errno), errno);
+		delay = serial->probe_delay;
+		serial->probe_delay = min(2 * serial->probe_delay, modem_profile.probe_max);
+		break;
 	}
-	LOG(LOG_DEBUG, "Leave");
-	return frames_extracted;
+	serial->g_source_boot = g_timeout_add(delay, power_sequence, serial);
+	return FALSE;
 }
 
 /**
- * Function responsible by all signal handlers treatment
- * any new signal must be added here
+ * Writes the cache file, errors are only logged.
  */
-void signal_treatment(
-	int param)
+static void cache_write(
+	GKeyFile* keys)
 {
-	switch (param)
+	GError* error = NULL;
+	gsize length;
+	gchar* data = g_key_file_to_data(keys, &length, NULL);
+	if (!g_file_set_contents(cache_file, data, length, &error))
 	{
-	case SIGPIPE:
-		exit(0);
-	break;
-	case SIGHUP:
-//reread the configuration files
-	break;
-	case SIGINT:
-	case SIGTERM:
-	case SIGUSR1:
-		//exit(0);
-//sig_term(param);
-		g_main_loop_quit(main_loop);
-	break;
-	case SIGKILL:
-	default:
-		exit(0);
-	break;
+		LOG(LOG_WARNING, "Couldn't write the cache %s: %s", cache_file, error->message);
+		g_error_free(error);
 	}
+	g_free(data);
 }
 
-static int modem_hw_(const char* pm_base_dir, const char* entry, int on)
+/**
+ * Starts choosing the mux parameters over from the configured ones, what
+ * an earlier start lowered for another modem doesn't stick.
+ */
+static void cmux_configure()
 {
-	LOG(LOG_DEBUG, "Enter");
-	if (pm_base_dir != NULL)
+	cmux_mode = cmux_mode_wanted;
+	cmux_subset = cmux_subset_wanted;
+	cmux_port_speed = cmux_port_speed_wanted;
+	cmux_N1 = cmux_N1_limit > 0 ? cmux_N1_limit : GSM0710_DEFAULT_N1;
+}
+
+/**
+ * Writes the options the mux parameters are chosen from, an entry of the
+ * cache only holds for the same ones.
+ */
+static void cache_options(
+	char *text,
+	int size)
+{
+	snprintf(text, size, "%d,%d,%d,%d,%d", cmux_mode_wanted, cmux_subset_wanted,
+		baud_rates[cmux_port_speed_wanted], cmux_N1_limit, cmux_k);
+}
+
+/**
+ * Takes the mux parameters cached for the serial device, if they were
+ * found out with the same options. Whether the modem is still the same
+ * shows when they are used: AT+CMUX= fails or the control channel is
+ * refused, and the entry is dropped.
+ *
+ * RETURNS:
+ * 1 if the parameters were taken, 0 otherwise
+ */
+static int cache_lookup(
+	Serial* serial)
+{
+	GKeyFile* keys;
+	GError* error = NULL;
+	gchar* cached;
+	char options[GSM0710_NAME_SIZE];
+	int mode, subset, port_speed, N1, found = 0;
+	if (cache_file == NULL)
+		return 0;
+	keys = g_key_file_new();
+	if (!g_key_file_load_from_file(keys, cache_file, G_KEY_FILE_NONE, NULL)
+		|| (cached = g_key_file_get_string(keys, serial->devicename, "Options", NULL)) == NULL)
 	{
-		char fn[256];
-		SYSCHECK(snprintf(fn, sizeof(fn), "%s/%s", pm_base_dir, entry));
-		LOG(LOG_DEBUG, "echo %c > %s", on?'1':'0', fn);
-		int fd;
-		SYSCHECK(fd = open(fn, O_RDWR | O_NONBLOCK));
-		SYSCHECK(write(fd, on?"1\n":"0\n", 2));
-		SYSCHECK(close(fd));
+		g_key_file_free(keys);
+		return 0;
 	}
+	cache_options(options, sizeof(options));
+	mode = g_key_file_get_integer(keys, serial->devicename, "Mode", &error);
+	subset = g_key_file_get_integer(keys, serial->devicename, "Subset", error ? NULL : &error);
+	port_speed = g_key_file_get_integer(keys, serial->devicename, "PortSpeed", error ? NULL : &error);
+	N1 = g_key_file_get_integer(keys, serial->devicename, "FrameSize", error ? NULL : &error);
+	if (error != NULL)
+	{
+		LOG(LOG_WARNING, "Broken cache entry for %s: %s", serial->devicename, error->message);
+		g_error_free(error);
+	}
+	else if (strcmp(cached, options) != 0)
+		LOG(LOG_INFO, "The cached mux parameters for %s were found with other options, probing", serial->devicename);
+	else if ((mode != 0 && mode != 1) || port_speed < 1 || port_speed >= sizeof(baud_rates) / sizeof(*baud_rates)
+		|| N1 < 1 || N1 > GSM0710_MAX_N1
+		|| (cmux_N1_limit > 0 && N1 > cmux_N1_limit))
+		LOG(LOG_INFO, "The cached mux parameters for %s don't fit, probing", serial->devicename);
 	else
-		LOG(LOG_DEBUG, "no pm_base_dir");
-	LOG(LOG_DEBUG, "Leave");
-	return 0;
+	{
+		cmux_mode = mode;
+		cmux_subset = subset;
+		cmux_port_speed = port_speed;
+		cmux_N1 = N1;
+		found = 1;
+		LOG(LOG_INFO, "Using the mux parameters cached for %s: %s mode, subset %d, %d baud, frame size %d",
+			serial->devicename, cmux_mode ? "advanced" : "basic", cmux_subset, baud_rates[cmux_port_speed], cmux_N1);
+	}
+	g_free(cached);
+	g_key_file_free(keys);
+	serial->cache_hit = found;
+	return found;
+}
+
+/**
+ * Caches the mux parameters, the control channel was opened with them.
+ */
+static void cache_save(
+	Serial* serial)
+{
+	GKeyFile* keys;
+	if (cache_file == NULL || serial->cache_hit || serial->modem_id[0] == '\0')
+		return;
+	keys = g_key_file_new();
+	g_key_file_load_from_file(keys, cache_file, G_KEY_FILE_KEEP_COMMENTS, NULL);
+	char options[GSM0710_NAME_SIZE];
+	cache_options(options, sizeof(options));
+	g_key_file_set_string(keys, serial->devicename, "Options", options);
+	g_key_file_set_string(keys, serial->devicename, "Identity", serial->modem_id);
+	g_key_file_set_integer(keys, serial->devicename, "Mode", cmux_mode);
+	g_key_file_set_integer(keys, serial->devicename, "Subset", cmux_subset);
+	g_key_file_set_integer(keys, serial->devicename, "PortSpeed", cmux_port_speed);
+	g_key_file_set_integer(keys, serial->devicename, "FrameSize", cmux_N1);
+	cache_write(keys);
+	g_key_file_free(keys);
+	serial->cache_hit = 1;
+	LOG(LOG_INFO, "Cached the mux parameters for %s", serial->devicename);
 }
 
-static int modem_hw_off(const char* pm_base_dir)
+/**
+ * Drops the cached mux parameters, they didn't work. The next start
+ * probes the modem again.
+ */
+static void cache_forget(
+	Serial* serial)
 {
-	LOG(LOG_DEBUG, "Enter");
-	SYSCHECK(modem_hw_(pm_base_dir, "power_on", 0));
-	SYSCHECK(modem_hw_(pm_base_dir, "reset", 0));
-	LOG(LOG_DEBUG, "Leave");
-	return 0;
+	GKeyFile* keys;
+	if (cache_file == NULL || !serial->cache_hit)
+		return;
+	LOG(LOG_WARNING, "The cached mux parameters for %s failed, dropping them", serial->devicename);
+	keys = g_key_file_new();
+	if (g_key_file_load_from_file(keys, cache_file, G_KEY_FILE_KEEP_COMMENTS, NULL)
+		&& g_key_file_remove_group(keys, serial->devicename, NULL))
+		cache_write(keys);
+	g_key_file_free(keys);
+	serial->cache_hit = 0;
 }
 
-static int modem_hw_on(const char* pm_base_dir)
+/**
+ * Starts the power sequence, it runs from the main loop.
+ */
+static void power_sequence_start(
+	Serial* serial)
 {
-	LOG(LOG_DEBUG, "Enter");
-	SYSCHECK(modem_hw_off(pm_base_dir));
-	sleep(1);
-	SYSCHECK(modem_hw_(pm_base_dir, "power_on", 1));
-	sleep(1);
-	SYSCHECK(modem_hw_(pm_base_dir, "reset", 1));
-	sleep(1);
-	SYSCHECK(modem_hw_(pm_base_dir, "reset", 0));
-	sleep(4);
-	LOG(LOG_DEBUG, "Leave");
-	return 0;
+	serial->state = MUX_STATE_POWERING;
+	serial->boot_step = serial->pm_base_dir != NULL ? 0 : 3;
+	serial->g_source_boot = g_timeout_add(serial->pm_base_dir != NULL ? modem_profile.off_delay : 0,
+		power_sequence, serial);
 }
 
-gboolean serial_device_read(GIOChannel *source, GIOCondition condition, gpointer data)
+/**
+ * Starts reading the frames the modem sends, in the main loop or in the
+ * serial I/O thread.
+ *
+ * RETURNS:
+ * 0 on success, -1 on error
+ */
+static int serial_receive_start(
+	Serial* serial)
 {
-	Serial* serial = (Serial*)data;
-	LOG(LOG_DEBUG, "Enter");
-	if (condition == G_IO_IN)
+	if (serial->g_channel == NULL)
+		serial->g_channel = g_io_channel_unix_new(serial->fd);
+	if (!use_thread)
+		serial->g_source = mux_watch_add(serial->g_channel, G_IO_IN | G_IO_HUP, serial_device_read, serial);
+	else if (serial_thread_start(serial) < 0)
 	{
-		switch (serial->state)
-		{
-		case MUX_STATE_MUXING:
-		{
-			unsigned char buf[4096];
-			int len;
-			//input from serial port
-			LOG(LOG_DEBUG, "Serial Data");
-			int length;
-			if ((length = gsm0710_buffer_free(serial->in_buf)) > 0
-			&& (len = read(serial->fd, buf, min(length, sizeof(buf)))) > 0)
-			{
-				syslogdump("<s ", buf, len);
-				gsm0710_buffer_write(serial->in_buf, buf, len);
-				//extract and handle ready frames
-				if (extract_frames(serial->in_buf) > 0)
-				{
-					time(&serial->frame_receive_time); //get the current time
-					serial->ping_number = 0;
-				}
-			}
-			LOG(LOG_DEBUG, "Leave keep watching");
-			return TRUE;
-		}
-		break;
-		default:
-			LOG(LOG_WARNING, "Don't know how to handle reading in state %d", serial->state);
-		break;
-		}
+		LOG(LOG_WARNING, "Could not start the serial I/O thread");
+		return -1;
 	}
-	else if (condition == G_IO_HUP)
+	return 0;
+}
+
+/**
+ * Sends a TEST frame to the control channel, a modem still in the
+ * mux-mode answers it. Without an answer after GSM0710_RESUME_TRIES the
+ * modem is started afresh.
+ */
+static gboolean resume_probe(
+	gpointer data)
+{
+	Serial* serial = (Serial*)data;
+	serial->g_source_boot = -1;
+	if (serial->resume_tries++ < GSM0710_RESUME_TRIES)
 	{
-		LOG(LOG_WARNING, "hup on serial file, closing");
-		serial->state = MUX_STATE_CLOSING;				
+		write_frame(0, test_channel_cmd, sizeof(test_channel_cmd), GSM0710_TYPE_UIH);
+		serial->g_source_boot = g_timeout_add(GSM0710_RESUME_TIMEOUT, resume_probe, serial);
+		return FALSE;
 	}
-	LOG(LOG_DEBUG, "Leave stop watching");
+	LOG(LOG_INFO, "No mux-mode to take over, starting the modem afresh");
+	serial->resume_tries = -1;
+	tx_drain(GSM0710_DRAIN_TIMEOUT);
+	mux_watch_remove(serial->g_source);
+	serial->g_source = -1;
+	serial_thread_stop();
+	if (modem_hw_off(serial->pm_base_dir) < 0)
+		LOG(LOG_WARNING, "Could not power off the modem");
+	power_sequence_start(serial);
 	return FALSE;
 }
 
+/**
+ * The modem answered the TEST frame, the mux-mode of the earlier run is
+ * taken over as it is. The channels are opened again by AllocChannel, a
+ * SABM for a DLC still open is answered with UA.
+ */
+static void resume_done(
+	Serial* serial)
+{
+	if (serial->g_source_boot != (guint)-1)
+		g_source_remove(serial->g_source_boot);
+	serial->g_source_boot = -1;
+	serial->resume_tries = -1;
+	LOG(LOG_INFO, "The modem is still in the mux-mode, taking it over");
+	boot_mark(serial, &serial->boot_cmux, "mux-mode resumed");
+	serial->state = MUX_STATE_MUXING;
+	write_frame(0, NULL, 0, GSM0710_TYPE_SABM | GSM0710_PF);
+}
+
 int open_serial_device(
 	Serial* serial
 	)
 {
 	LOG(LOG_DEBUG, "Enter");
-	SYSCHECK(modem_hw_on(serial->pm_base_dir));
+	cmux_configure();
+	clock_gettime(CLOCK_MONOTONIC, &serial->boot_started);
+	serial->boot_first_at = serial->boot_cmux = serial->boot_first_channel = -1;
+//the mux-mode of an earlier run is only looked for once, later on
+//close_devices() ended it
+	int resume = use_resume && serial->resume_tries == 0;
+//its parameters aren't asked for, but the cache may know them
+	serial->cache_hit = 0;
+	if (resume)
+		cache_lookup(serial);
+	SYSCHECK(session_open(serial));
+	if (!resume)
+		SYSCHECK(modem_hw_off(serial->pm_base_dir));
 	int i;
 	for (i=0;i<GSM0710_MAX_CHANNELS;i++)
 		SYSCHECK(logical_channel_init(channellist+i, i));
 //open the serial port
+//it stays non-blocking, the transmit queue waits for the port instead
 	SYSCHECK(serial->fd = open(serial->devicename, O_RDWR | O_NOCTTY | O_NONBLOCK));
 	LOG(LOG_INFO, "Opened serial port");
-	int fdflags;
-	SYSCHECK(fdflags = fcntl(serial->fd, F_GETFL));
-	SYSCHECK(fcntl(serial->fd, F_SETFL, fdflags & ~O_NONBLOCK));
 	struct termios t;
 	tcgetattr(serial->fd, &t);
 	t.c_cflag &= ~(CSIZE | CSTOPB | PARENB | PARODD);
@@ -1685,85 +4975,277 @@ int open_serial_device(
 	t.c_cc[VSTART] = _POSIX_VDISABLE;
 	t.c_cc[VSTOP] = _POSIX_VDISABLE;
 	t.c_cc[VSUSP] = _POSIX_VDISABLE;
-	speed_t speed = baud_bits[cmux_port_speed];
-	cfsetispeed(&t, speed);
-	cfsetospeed(&t, speed);
 	SYSCHECK(tcsetattr(serial->fd, TCSANOW, &t));
+	serial->speed = 0;
+	SYSCHECK(serial_set_speed(serial, baud_rates[cmux_port_speed]));
+	serial->rpn_asked = -1;
+	serial->rpn_switch = 0;
+	serial->rpn_testing = 0;
 	int status = TIOCM_DTR | TIOCM_RTS;
 	ioctl(serial->fd, TIOCMBIS, &status);
 	LOG(LOG_INFO, "Configured serial device");
 	serial->ping_number = 0;
 	time(&serial->frame_receive_time); //get the current time
-	serial->state = MUX_STATE_INITILIZING;
+	clock_gettime(CLOCK_MONOTONIC, &serial->started);
+	serial->cpu_started = cpu_time();
+	serial->loop_wakeups = 0;
+	serial->tx_payload = serial->rx_payload = 0;
+	if (!resume)
+	{
+		power_sequence_start(serial);
+		return 0;
+	}
+	LOG(LOG_INFO, "Looking for a mux-mode left by an earlier run");
+	serial->state = MUX_STATE_RESUMING;
+	if (serial_receive_start(serial) < 0)
+	{
+		serial->resume_tries = -1;
+		serial->state = MUX_STATE_CLOSING;
+		return -1;
+	}
+	resume_probe(serial);
 	return 0;
 }
 
+/**
+ * Opens the control channel once the modem settled in the mux-mode.
+ */
+static gboolean start_muxing(
+	gpointer data)
+{
+	Serial* serial = (Serial*)data;
+	serial->g_source_boot = -1;
+	serial->state = MUX_STATE_MUXING;
+	LOG(LOG_INFO, "Init control channel");
+	if (serial_receive_start(serial) < 0)
+	{
+		serial->state = MUX_STATE_CLOSING;
+		return FALSE;
+	}
+	write_frame(0, NULL, 0, GSM0710_TYPE_SABM | GSM0710_PF);
+	return FALSE;
+}
+
+/**
+ * Writes the +CMUX command for the parameters chosen.
+ */
+static void cmux_command(
+	char *text,
+	int size)
+{
+	if (!error_recovery())
+		snprintf(text, size, "AT+CMUX=%d,%d,%d,%d"
+			, cmux_mode
+			, cmux_subset
+			, cmux_port_speed
+			, cmux_N1
+			);
+	else
+		snprintf(text, size, "AT+CMUX=%d,%d,%d,%d,%d,%d,%d,%d,%d"
+			, cmux_mode
+			, cmux_subset
+			, cmux_port_speed
+			, cmux_N1
+			, cmux_T1
+			, cmux_N2
+			, cmux_T2
+			, cmux_T3
+			, cmux_k
+			);
+}
+
+/**
+ * Chooses the mux parameters from the +CMUX=? answer: the configured
+ * mode if the modem has it, the configured port speed or the fastest
+ * below, the largest frame size up to -f or GSM0710_MAX_N1, even if the
+ * modem asks for larger ones.
+ */
+static void cmux_ranges(
+	Serial* serial,
+	const char *line)
+{
+	GPtrArray *table;
+	int *range[4];
+	int i, limit;
+	if (strncmp(line, "+CMUX:", 6) != 0)
+		return;
+	table = parse(line + 6);
+	if (table->len < 4)
+		LOG(LOG_WARNING, "Can't make sense of '%s', keeping the mux parameters", line);
+	else
+	{
+		for (i = 0; i < 4; i++)
+			range[i] = g_ptr_array_index(table, i);
+		cmux_mode = min(max(cmux_mode, range[0][0]), range[0][1]);
+		cmux_subset = min(max(cmux_subset, range[1][0]), range[1][1]);
+		cmux_port_speed = min(max(cmux_port_speed, range[2][0]), range[2][1]);
+		cmux_port_speed = min(max(cmux_port_speed, 1), (int)(sizeof(baud_rates) / sizeof(*baud_rates)) - 1);
+		limit = cmux_N1_limit > 0 ? cmux_N1_limit : GSM0710_MAX_N1;
+		cmux_N1 = min(limit, range[3][1]);
+//no frame goes above -f, the modem may still take it
+		if (cmux_N1 < range[3][0])
+			LOG(LOG_WARNING, "Modem wants frames of at least %d bytes, keeping %d", range[3][0], cmux_N1);
+		LOG(LOG_INFO, "Modem offers%s, choosing %s mode, subset %d, %d baud, frame size %d",
+			line + 6, cmux_mode ? "advanced" : "basic", cmux_subset, baud_rates[cmux_port_speed], cmux_N1);
+	}
+	for (i = 0; i < table->len; i++)
+		free(g_ptr_array_index(table, i));
+	g_ptr_array_free(table, TRUE);
+//AT+CMUX= isn't sent yet
+	if (serial->at_cmux != NULL)
+		cmux_command(serial->at_cmux->text, sizeof(serial->at_cmux->text));
+}
+
+/**
+ * Adds what ATI and +CGMR tell to the identity of the modem. Unsolicited
+ * result codes coming in between, like +CREG: or RING, are left out.
+ */
+static void modem_identity(
+	Serial* serial,
+	const char *line)
+{
+	static const char* unsolicited[] = {"RING", "NO CARRIER", "+", "^", "%", "*", NULL};
+	int i, length = strlen(serial->modem_id);
+	if (!strncmp(line, "+CGMR:", 6))
+		for (line += 6; *line == ' '; line++)
+			;
+	else
+		for (i = 0; unsolicited[i] != NULL; i++)
+			if (!strncmp(line, unsolicited[i], strlen(unsolicited[i])))
+				return;
+	snprintf(serial->modem_id + length, sizeof(serial->modem_id) - length, "%s%s",
+		length > 0 ? " " : "", line);
+}
+
+/**
+ * The modem took the AT commands, it is given the time the profile asks
+ * for to settle in the mux-mode. On failure the watchdog starts over.
+ */
+static void start_muxer_done(
+	Serial* serial,
+	int result)
+{
+	int i;
+	if (result < 0)
+	{
+		LOG(LOG_WARNING, "Could not configure the modem, trying again");
+		if (serial->at_cmux == &serial->at.script[serial->at.answered])
+			cache_forget(serial);
+		return;
+	}
+//the modem switched to the port speed of +CMUX
+	if (serial->speed != baud_rates[cmux_port_speed])
+	{
+		LOG(LOG_INFO, "Switching the serial port to %d baud", baud_rates[cmux_port_speed]);
+		if (serial_set_speed(serial, baud_rates[cmux_port_speed]) < 0)
+		{
+			serial->state = MUX_STATE_CLOSING;
+			return;
+		}
+	}
+//no channel is open yet, so the session memory can follow the frame
+//size and mode chosen
+	if (serial->arena_N1 != cmux_N1 || serial->arena_k != (error_recovery() ? cmux_k : 0))
+	{
+		LOG(LOG_INFO, "Sizing the session for a frame size of %d", cmux_N1);
+		if (session_open(serial) < 0)
+		{
+			serial->state = MUX_STATE_CLOSING;
+			return;
+		}
+		for (i = 0; i < GSM0710_MAX_CHANNELS; i++)
+			logical_channel_init(channellist+i, i);
+	}
+	if (error_recovery())
+		LOG(LOG_INFO, "Error recovery mode, T1 %d ms, N2 %d, window %d", cmux_T1 * 10, cmux_N2, cmux_k);
+	boot_mark(serial, &serial->boot_cmux, "mux-mode");
+	LOG(LOG_INFO, "Waiting for mux-mode");
+	serial->g_source_boot = g_timeout_add(modem_profile.cmux_settle, start_muxing, serial);
+}
+
 int start_muxer(
 	Serial* serial
 	)
 {
 	LOG(LOG_INFO, "Configuring modem");
 	char gsm_command[100];
-	if (chat(serial->fd, "\r\n\r\n\r\nAT\r\n", 1) < 0)
+	AtCommand* command;
+	at_script_start(serial);
+	at_add(serial, "\r\n\r\n\r\nAT", 1000, AT_LEAVE_MUX);
+	at_add(serial, "ATZ", 3000, 0);
+	at_add(serial, "ATE0", 1000, 0);
+	if (0)// additional siemens c35 init
 	{
-		LOG(LOG_WARNING, "Modem does not respond to AT commands, trying close mux mode");
-		//if (cmux_mode) we do not know now so write both
-			write_frame(0, NULL, 0, GSM0710_CONTROL_CLD | GSM0710_CR);
-		//else
-			write_frame(0, close_channel_cmd, 2, GSM0710_TYPE_UIH);
-		SYSCHECK(chat(serial->fd, "AT\r\n", 1));
+		SYSCHECK(snprintf(gsm_command, sizeof(gsm_command), "AT+IPR=%d", baud_rates[cmux_port_speed]));
+		at_add(serial, gsm_command, 1000, 0);
+		at_add(serial, "AT", 1000, 0);
+		at_add(serial, "AT&S0", 1000, AT_PIPELINE);
+		at_add(serial, "AT\\Q3", 1000, AT_PIPELINE);
 	}
-	SYSCHECK(chat(serial->fd, "ATZ\r\n", 3));
-	SYSCHECK(chat(serial->fd, "ATE0\r\n", 1));
-	if (0)// additional siemens c35 init
+	serial->modem_id[0] = '\0';
+	serial->cache_hit = 0;
+//with an entry in the cache AT+CMUX= goes with its parameters, without
+//asking the modem, the identity is only needed to write a new entry
+	cmux_configure();
+	if (!cache_lookup(serial))
 	{
-		SYSCHECK(snprintf(gsm_command, sizeof(gsm_command), "AT+IPR=%d\r\n", baud_rates[cmux_port_speed]));
-		SYSCHECK(chat(serial->fd, gsm_command, 1));
-		SYSCHECK(chat(serial->fd, "AT\r\n", 1));
-		SYSCHECK(chat(serial->fd, "AT&S0\r\n", 1));
-		SYSCHECK(chat(serial->fd, "AT\\Q3\r\n", 1));
+		if (cache_file != NULL)
+		{
+			if ((command = at_add(serial, "ATI", 1000, AT_MAY_FAIL)) != NULL)
+				command->response = modem_identity;
+			if ((command = at_add(serial, "AT+CGMR", 1000, AT_MAY_FAIL | AT_PIPELINE)) != NULL)
+				command->response = modem_identity;
+		}
+		if ((command = at_add(serial, "AT+CMUX=?", 1000, AT_MAY_FAIL)) != NULL)
+			command->response = cmux_ranges;
 	}
-	//SYSCHECK(chat(serial->fd, "AT+CMUX=?\r\n", 1));
 	if (pin_code >= 0)
 	{
 		LOG(LOG_DEBUG, "send pin %04d", pin_code);
 //Some modems, such as webbox, will sometimes hang if SIM code
 //is given in virtual channel
-		SYSCHECK(snprintf(gsm_command, sizeof(gsm_command), "AT+CPIN=%04d\r\n", pin_code));
-		SYSCHECK(chat(serial->fd, gsm_command, 10));
-	}
-	SYSCHECK(chat(serial->fd, "AT+CFUN=0\r\n", 10));
-	SYSCHECK(snprintf(gsm_command, sizeof(gsm_command), "AT+CMUX=%d,%d,%d,%d"
-		//",%d,%d,%d,%d,%d"
-		"\r\n"
-		, cmux_mode
-		, cmux_subset
-		, cmux_port_speed
-		, cmux_N1
-		//, cmux_T1
-		//, cmux_N2
-		//, cmux_T2
-		//, cmux_T3
-		//, cmux_k
-		));
+		SYSCHECK(snprintf(gsm_command, sizeof(gsm_command), "AT+CPIN=%04d", pin_code));
+		at_add(serial, gsm_command, 10000, AT_PIPELINE);
+	}
+	at_add(serial, "AT+CFUN=0", 10000, AT_PIPELINE);
+	cmux_command(gsm_command, sizeof(gsm_command));
+//the mux-mode starts with the answer, nothing may follow it
+	serial->at_cmux = at_add(serial, gsm_command, 3000, 0);
 	LOG(LOG_INFO, "Starting mux mode");
-	SYSCHECK(chat(serial->fd, gsm_command, 3));
-	serial->state = MUX_STATE_MUXING;
-	LOG(LOG_INFO, "Waiting for mux-mode");
-	sleep(1);
-	LOG(LOG_INFO, "Init control channel");
-	write_frame(0, NULL, 0, GSM0710_TYPE_SABM | GSM0710_PF);
-	GIOChannel* channel = g_io_channel_unix_new(serial->fd);
-	serial->g_source = g_io_add_watch(channel, G_IO_IN | G_IO_HUP, serial_device_read, serial);
+	at_run(serial, start_muxer_done);
 	return 0;
 }
 
 static int close_devices()
 {
 	LOG(LOG_DEBUG, "Enter");
-	g_source_remove(serial.g_source);
+//on exit with -R the next run takes the mux-mode over
+	int keep_muxing = use_resume && !main_running && serial.state == MUX_STATE_MUXING;
+//the next run starts at the speed of +CMUX, not the one of RPN
+	if (keep_muxing && (serial.speed != baud_rates[cmux_port_speed] || serial.rpn_switch))
+	{
+		LOG(LOG_INFO, "The link runs at %d baud after RPN, closing the mux-mode", serial.rpn_switch ? serial.rpn_switch : serial.speed);
+		keep_muxing = 0;
+	}
+//the switch can't wait for the queue any longer, it goes at the old speed
+	if (serial.g_source_rpn != (guint)-1)
+		g_source_remove(serial.g_source_rpn);
+	serial.g_source_rpn = -1;
+	serial.rpn_switch = 0;
+	serial.rpn_testing = 0;
+	mux_watch_remove(serial.g_source);
 	serial.g_source = -1;
+	serial_thread_stop();
+	power_sequence_stop(&serial);
 	int i;
+//answer the calls still waiting for a channel, drop the handshakes
+	for (i=1;i<GSM0710_MAX_CHANNELS;i++)
+	{
+		channel_alloc_reply(channellist+i, "Muxer closed");
+		if (channellist[i].closing)
+			channel_close_done(channellist+i);
+		i_frames_reset(channellist+i);
+	}
 // don't bother closing the channels over the MUX protocol, first off,
 // the mainloop is no longer running anyways, second, we're about to
 // shutdown the modem completely in a second.
@@ -1784,26 +5266,64 @@ static int close_devices()
 		}
 	}
 #endif
+	if (serial.fd >= 0 && keep_muxing)
+	{
+		LOG(LOG_INFO, "Leaving the modem in the mux-mode for the next run");
+		tx_drain(GSM0710_DRAIN_TIMEOUT);
+		SYSCHECK(close(serial.fd));
+		serial.fd = -1;
+	}
 	if (serial.fd >= 0)
 	{
 		if (cmux_mode)
 			write_frame(0, NULL, 0, GSM0710_CONTROL_CLD | GSM0710_CR);
 		else
 			write_frame(0, close_channel_cmd, 2, GSM0710_TYPE_UIH);
+		tx_drain(GSM0710_DRAIN_TIMEOUT);
 		static const char* poff = "AT@POFF\r\n";
 		syslogdump(">s ", (unsigned char *)poff, strlen(poff));
 		write(serial.fd, poff, strlen(poff));
 		SYSCHECK(close(serial.fd));
 		serial.fd = -1;
 	}
-	SYSCHECK(modem_hw_off(serial.pm_base_dir));
+	if (serial.g_source_out != (guint)-1)
+		mux_watch_remove(serial.g_source_out);
+	serial.g_source_out = -1;
+	if (serial.g_channel != NULL)
+		g_io_channel_unref(serial.g_channel);
+	serial.g_channel = NULL;
+	serial.tx_blocked = 0;
+	if (serial.in_buf != NULL)
+		LOG(LOG_INFO, "Received %ld frames and dropped %ld received frames during the mux-mode",
+			serial.in_buf->received_count, serial.in_buf->dropped_count);
+	LOG(LOG_INFO, "Sent %ld frames in %ld flushes, %ld bytes with %ld write calls during the mux-mode",
+		serial.tx_frames, serial.tx_flushes, serial.tx_bytes, serial.tx_syscalls);
+	LOG(LOG_INFO, "Sent %ld wakeup sequences, suppressed %ld during the mux-mode",
+		serial.tx_wakeups, serial.tx_wakeups_suppressed);
+	LOG(LOG_INFO, "Wrote %ld frames to the ptys with %ld write calls during the mux-mode",
+		serial.rx_pty_frames, serial.rx_pty_syscalls);
+	LOG(LOG_INFO, "The main loop was busy for %ld us at most without polling",
+		serial.loop_busy_max);
+	link_throughput(&serial);
+	serial.speed = 0;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double secs = now.tv_sec - serial.started.tv_sec + (now.tv_nsec - serial.started.tv_nsec) / 1e9;
+	double mb = (serial.tx_payload + serial.rx_payload) / (1024.0 * 1024.0);
+	LOG(LOG_INFO, "%lu wakeups, %.2f per second, %.1f ms CPU per MB relayed during the mux-mode",
+		serial.loop_wakeups, serial.loop_wakeups / max(secs, 1.0), (cpu_time() - serial.cpu_started) / max(mb, 1e-6));
+#ifdef GSM0710_ALLOC_CHECK
+	LOG(LOG_INFO, "%lu heap allocations on the data path during the mux-mode", alloc_check_count);
+#endif
+	session_close(&serial);
+	if (!keep_muxing)
+		SYSCHECK(modem_hw_off(serial.pm_base_dir));
 	serial.state = MUX_STATE_OFF;
 	return 0;
 }
 
 static gboolean watchdog(gpointer data)
 {
-	int i;
 	LOG(LOG_DEBUG, "Enter");
 	Serial* serial = (Serial*)data;
 	LOG(LOG_DEBUG, "Serial state is %d", serial->state);
@@ -1812,16 +5332,20 @@ static gboolean watchdog(gpointer data)
 	case MUX_STATE_OPENING:
 		if (open_serial_device(serial) < 0)
 			LOG(LOG_WARNING, "Could not open all devices and start muxer");
-		serial->g_source_watchdog = g_timeout_add_seconds(1, watchdog, data); // let the dog watch every 1 sec
+		watchdog_start(serial); // let the dog watch every 1 sec
 		LOG(LOG_INFO, "Watchdog started");
+	break;
+	case MUX_STATE_RESUMING:
+//resume_probe() decides
+	break;
+	case MUX_STATE_POWERING:
+//power_sequence() goes on when the modem answers
+	break;
 	case MUX_STATE_INITILIZING:
-		if (start_muxer(serial) < 0)
+		if (serial->g_source_boot == (guint)-1 && start_muxer(serial) < 0)
 			LOG(LOG_WARNING, "Could not open all devices and start muxer errno=%d", errno);
 	break;
 	case MUX_STATE_MUXING:
-		for (i=1;i<GSM0710_MAX_CHANNELS;i++)
-			if (channellist[i].fd >= 0)
-				g_io_channel_flush(channellist[i].g_channel, NULL);
 		if (use_ping)
 		{
 			if (serial->ping_number > use_ping)
@@ -1856,33 +5380,139 @@ static gboolean watchdog(gpointer data)
 		LOG(LOG_WARNING, "Don't know how to handle state %d", serial->state);
 	break;
 	}
+	watchdog_schedule(serial);
 	return 1;
 }
 
+static gboolean watchdog_timer(GIOChannel *source, GIOCondition condition, gpointer data)
+{
+	uint64_t expirations;
+	if (read(watchdog_fd, &expirations, sizeof(expirations)) < 0)
+		return TRUE;
+	return watchdog(data);
+}
+
+/**
+ * The epoll backend only wakes the watchdog while it has something to
+ * do. Muxing without ping and timeout it sleeps until the state
+ * changes.
+ */
+static void watchdog_schedule(
+	Serial* serial)
+{
+	struct itimerspec interval;
+	int needed = serial->g_source_watchdog != (guint)-1
+		&& (serial->state != MUX_STATE_MUXING || use_ping || use_timeout);
+	if (!use_epoll || needed == watchdog_armed)
+		return;
+	memset(&interval, 0, sizeof(interval));
+	if (needed)
+		interval.it_value.tv_sec = interval.it_interval.tv_sec = 1;
+	timerfd_settime(watchdog_fd, 0, &interval, NULL);
+	watchdog_armed = needed;
+}
+
+static void watchdog_start(
+	Serial* serial)
+{
+	if (serial->g_source_watchdog != (guint)-1)
+		return;
+	if (use_epoll)
+	{
+		serial->g_source_watchdog = mux_watch_add(watchdog_channel, G_IO_IN, watchdog_timer, serial);
+		watchdog_schedule(serial);
+	}
+	else
+		serial->g_source_watchdog = g_timeout_add_seconds(1, watchdog, serial);
+}
+
+static void watchdog_stop(
+	Serial* serial)
+{
+	if (serial->g_source_watchdog == (guint)-1)
+		return;
+	mux_watch_remove(serial->g_source_watchdog);
+	serial->g_source_watchdog = -1;
+	watchdog_schedule(serial);
+}
+
+/**
+ * Selects the timing of the power sequence, a profile by name or the
+ * delays in ms separated by commas.
+ *
+ * RETURNS:
+ * 0 on success, -1 if the profile is unknown or the delays don't make sense
+ */
+static int modem_profile_select(
+	const char *profile)
+{
+	ModemProfile custom = { "custom", };
+	int i;
+	for (i = 0; i < sizeof(modem_profiles) / sizeof(*modem_profiles); i++)
+		if (!strcmp(profile, modem_profiles[i].name))
+		{
+			modem_profile = modem_profiles[i];
+			return 0;
+		}
+	if (sscanf(profile, "%d,%d,%d,%d,%d,%d,%d", &custom.off_delay, &custom.power_delay, &custom.reset_pulse,
+		&custom.probe_first, &custom.probe_max, &custom.boot_timeout, &custom.cmux_settle) != 7
+		|| custom.off_delay < 0 || custom.power_delay < 0 || custom.reset_pulse < 0
+		|| custom.probe_first <= 0 || custom.probe_max < custom.probe_first
+		|| custom.boot_timeout < 0 || custom.cmux_settle < 0)
+		return -1;
+	modem_profile = custom;
+	return 0;
+}
+
 /**
  * shows how to use this program
  */
 static int usage(
 	char *_name)
 {
+	int i;
 	fprintf(stdout, "Usage: %s [options]\n", _name);
 	fprintf(stdout, "Options:\n");
 	// process control
 	fprintf(stdout, "\t-d: Fork, get a daemon [%s]\n", no_daemon?"no":"yes");
 	fprintf(stdout, "\t-v: verbose logging\n");
+	fprintf(stdout, "\t-e: watch the serial port and the ptys with epoll instead of GLib [%s]\n", use_epoll?"yes":"no");
+	fprintf(stdout, "\t-T: service the serial port in a thread of its own [%s]\n", use_thread?"yes":"no");
 	// modem control
 	fprintf(stdout, "\t-s <serial port name>: Serial port device to connect to [%s]\n", serial.devicename);
 	fprintf(stdout, "\t-t <timeout>: reset modem after this number of seconds of silence [%d]\n", use_timeout);
 	fprintf(stdout, "\t-P <pin-code>: PIN code to unlock SIM [%d]\n", pin_code);
 	fprintf(stdout, "\t-p <number>: use ping and reset modem after this number of unanswered pings [%d]\n", use_ping);
 	fprintf(stdout, "\t-x <dir>: power managment base dir [%s]\n", serial.pm_base_dir?serial.pm_base_dir:"<not set>");
+	fprintf(stdout, "\t-a: send the AT commands which allow it without waiting for the previous answer [%s]\n", at_pipeline?"yes":"no");
+	fprintf(stdout, "\t-R: leave the modem in the mux-mode on exit and take it over on start [%s]\n", use_resume?"yes":"no");
+	fprintf(stdout, "\t-C <file>: cache of the mux parameters which worked with a modem [%s]\n", cache_file?cache_file:"<not set>");
+	fprintf(stdout, "\t-w <ms>: send the wakeup sequence after this many milliseconds of silence on the link [%d]\n", wakeup_idle);
+	fprintf(stdout, "\t-D <profile>: power sequence timing, one of");
+	for (i = 0; i < sizeof(modem_profiles) / sizeof(*modem_profiles); i++)
+		fprintf(stdout, " %s", modem_profiles[i].name);
+	fprintf(stdout, "\n\t\tor <off>,<power>,<reset>,<probe first>,<probe max>,<boot timeout>,<cmux settle> in ms [%s]\n",
+		modem_profile.name);
 	// legacy - will be removed
-	fprintf(stdout, "\t-b <baudrate>: mode baudrate [%d]\n", baud_rates[cmux_port_speed]);
-	fprintf(stdout, "\t-m <modem>: Mode (basic, advanced) [%s]\n", cmux_mode?"advanced":"basic");
-	fprintf(stdout, "\t-f <framsize>: Frame size [%d]\n", cmux_N1);
+	fprintf(stdout, "\t-b <baudrate>: mode baudrate, one of");
+	for (i = 1; i < sizeof(baud_rates) / sizeof(*baud_rates); i++)
+		fprintf(stdout, " %d", baud_rates[i]);
+	fprintf(stdout, " [%d]\n", baud_rates[cmux_port_speed_wanted]);
+	fprintf(stdout, "\t-E: error recovery mode, lost frames are sent again [%s]\n",
+		cmux_subset_wanted == GSM0710_SUBSET_I?"yes":"no");
+	fprintf(stdout, "\t-k <window>: frames sent before an acknowledgement in the error recovery mode, 1-%d [%d]\n", GSM0710_MAX_K, cmux_k);
+	fprintf(stdout, "\t-S <baudrate>: switch the link to this speed with RPN once muxing, one of");
+	for (i = 0; i < sizeof(rpn_rates) / sizeof(*rpn_rates); i++)
+		fprintf(stdout, " %d", rpn_rates[i]);
+	fprintf(stdout, " [%d]\n", rpn_speed);
+	fprintf(stdout, "\t-m <modem>: Mode (basic, advanced) [%s]\n", cmux_mode_wanted?"advanced":"basic");
+	fprintf(stdout, "\t-f <framsize>: Frame size, if not set the largest the modem allows up to %d [%d]\n", GSM0710_MAX_N1,
+		cmux_N1_limit > 0 ? cmux_N1_limit : GSM0710_DEFAULT_N1);
+	fprintf(stdout, "\t-r <bytes>: Receive buffer size up to %d, rounded up to a power of two [%d]\n", GSM0710_MAX_BUFFER_SIZE, buffer_size);
 	//
 	fprintf(stdout, "\t-h: Show this help message and show current settings.\n");
 	fprintf(stdout, "\t-V: Show the version number.\n");
+	fprintf(stdout, "\t-B: Benchmark the frame codec and exit.\n");
 	return -1;
 }
 
@@ -1905,6 +5535,257 @@ static int show_version(
 	return -1;
 }
 
+/**
+ * MB/s for bytes processed between start and stop
+ */
+static double benchmark_rate(
+	const struct timespec *start,
+	const struct timespec *stop,
+	double bytes)
+{
+	double secs = (stop->tv_sec - start->tv_sec) + (stop->tv_nsec - start->tv_nsec) / 1e9;
+	return bytes / secs / (1024 * 1024);
+}
+
+/**
+ * the modem and pty reader side of benchmark_relay(): writes to the pty
+ * and frames to the modem socket until told bytes are gone, reads what
+ * comes back until the muxer hangs up. Like a modem keeping to FC it
+ * has no more than half a pty queue in flight.
+ */
+static void benchmark_peer(
+	int pty,
+	int modem,
+	const unsigned char *wire,
+	int wire_length,
+	int chunk,
+	long pty_bytes,
+	long modem_bytes)
+{
+	static unsigned char buf[64 * 1024];
+	static const char *text = "AT+CGDCONT=1,\"IP\",\"internet\"\r\n";
+	struct pollfd pfd[2];
+	long sent = 0, received = 0, allowed;
+	int i, c;
+//only printable text, so the line discipline doesn't interfere
+	for (i = 0; i < sizeof(buf); i++)
+		buf[i] = text[i % strlen(text)];
+	pfd[0].fd = pty;
+	pfd[1].fd = modem;
+	for (;;)
+	{
+		allowed = min(modem_bytes, (received + GSM0710_PTY_QUEUE_SIZE(cmux_N1) / 2) * wire_length / chunk);
+		pfd[0].events = POLLIN | (pty_bytes > 0 ? POLLOUT : 0);
+		pfd[1].events = POLLIN | (sent < allowed ? POLLOUT : 0);
+		if (poll(pfd, 2, -1) < 0)
+			break;
+		if ((pfd[0].revents & POLLOUT) && (c = write(pty, buf, min(pty_bytes, 4096))) > 0)
+			pty_bytes -= c;
+		if ((pfd[1].revents & POLLOUT)
+		&& (c = write(modem, wire + sent % wire_length, min(wire_length - sent % wire_length, allowed - sent))) > 0)
+			sent += c;
+		if ((pfd[0].revents & POLLIN) && (c = read(pty, buf + 4096, sizeof(buf) - 4096)) <= 0)
+			pfd[0].fd = -1;
+		else if (pfd[0].revents & POLLIN)
+			received += c;
+		else if (pfd[0].revents & (POLLHUP | POLLERR))
+			pfd[0].fd = -1;
+		if ((pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) && read(modem, buf + 4096, sizeof(buf) - 4096) <= 0)
+			break;
+	}
+}
+
+/**
+ * relays data through a pty and a socket standing in for the modem, in
+ * both directions at once, and tells the wakeups and the CPU time per MB
+ * relayed as well as the wakeups per second while idle, with the GLib
+ * watches and with the epoll backend, each with and without the serial
+ * I/O thread
+ */
+static int benchmark_relay(
+	char *_name)
+{
+	static unsigned char data[4096];
+	static const char *backends[] = { "GLib", "epoll", "GLib, I/O thread", "epoll, I/O thread", };
+	const long total = 16 * 1024 * 1024;
+	const int idle = 5;
+	Channel* channel = channellist + 1;
+	unsigned char *wire;
+	int wire_length, chunk, modem[2], pty[GSM0710_MAX_CHANNELS], b, i;
+	long rx_total;
+	unsigned long wakeups, thread_wakeups;
+	double cpu, secs, mb;
+	struct timespec start, stop;
+	guint timeout_id;
+	GSource *timeout_source;
+	pid_t pid;
+	fprintf(stdout, "%s event loop benchmark, %ld bytes each way on one of %d channels\n",
+		_name, total, GSM0710_MAX_CHANNELS - 1);
+	for (b = 0; b < sizeof(backends) / sizeof(*backends); b++)
+	{
+		use_epoll = b & 1;
+		use_thread = b >> 1;
+		SYSCHECK(mux_loop_init());
+		SYSCHECK(session_open(&serial));
+		for (i = 0; i < GSM0710_MAX_CHANNELS; i++)
+			SYSCHECK(logical_channel_init(channellist + i, i));
+//N1 sized frames as they come from the modem, encoded like ours
+		link_touch(&serial);
+		while (tx_queue_frame(1, data, cmux_N1, GSM0710_TYPE_UIH) > 0)
+			;
+		if ((wire = malloc(serial.tx_queue.length)) == NULL)
+			return -1;
+		wire_length = serial.tx_queue.length;
+		memcpy(wire, serial.tx_queue.data, wire_length);
+		chunk = serial.tx_queue.frame_count * cmux_N1;
+		rx_total = total / chunk * chunk;
+		tx_queue_reset(&serial);
+		SYSCHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, modem));
+		SYSCHECK(fcntl(modem[0], F_SETFL, O_NONBLOCK));
+		serial.fd = modem[0];
+		serial.state = MUX_STATE_MUXING;
+		serial.g_channel = g_io_channel_unix_new(serial.fd);
+		if (use_thread)
+			SYSCHECK(serial_thread_start(&serial));
+		else
+			serial.g_source = mux_watch_add(serial.g_channel, G_IO_IN | G_IO_HUP, serial_device_read, &serial);
+//data goes through the first channel, the others are open but idle
+		for (i = 1; i < GSM0710_MAX_CHANNELS; i++)
+		{
+			SYSCHECK(channel_pty_open(channellist + i, "benchmark"));
+			channellist[i].opened = channellist[i].frames_allowed = 1;
+			SYSCHECK(pty[i] = open(channellist[i].ptsname, O_RDWR | O_NOCTTY | O_NONBLOCK));
+		}
+		fflush(stdout);
+		SYSCHECK(pid = fork());
+		if (pid == 0)
+		{
+			close(serial.fd);
+			benchmark_peer(pty[1], modem[1], wire, wire_length, chunk, total, rx_total / chunk * wire_length);
+			_exit(0);
+		}
+		close(pty[1]);
+		close(modem[1]);
+		free(wire);
+		watchdog_start(&serial);
+		serial.tx_payload = serial.rx_payload = 0;
+		serial.loop_wakeups = 0;
+		thread_wakeups = __atomic_load_n(&serial_thread.wakeups, __ATOMIC_RELAXED);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		cpu = cpu_time();
+		while (serial.tx_payload < total || serial.rx_payload < rx_total
+		|| serial.tx_queue.length > 0 || channel->out_length > 0)
+			mux_iteration(TRUE);
+		cpu = cpu_time() - cpu;
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		wakeups = serial.loop_wakeups + __atomic_load_n(&serial_thread.wakeups, __ATOMIC_RELAXED) - thread_wakeups;
+		mb = (serial.tx_payload + serial.rx_payload) / (1024.0 * 1024.0);
+		secs = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+//nothing to relay, only the timers wake the loop
+		serial.loop_wakeups = 0;
+		thread_wakeups = __atomic_load_n(&serial_thread.wakeups, __ATOMIC_RELAXED);
+		timeout_id = g_timeout_add_seconds(idle, glib_returnfalse, NULL);
+		timeout_source = g_source_ref(g_main_context_find_source_by_id(NULL, timeout_id));
+		do
+			mux_iteration(TRUE);
+		while (!g_source_is_destroyed(timeout_source));
+		g_source_unref(timeout_source);
+		thread_wakeups = __atomic_load_n(&serial_thread.wakeups, __ATOMIC_RELAXED) - thread_wakeups;
+		fprintf(stdout, "\t%s: %.1f MB/s, %.1f wakeups and %.1f ms CPU per MB relayed, %.2f wakeups/s idle\n",
+			backends[b], mb / secs, wakeups / mb, cpu / mb, (serial.loop_wakeups + thread_wakeups) / (double)idle);
+		watchdog_stop(&serial);
+		for (i = 1; i < GSM0710_MAX_CHANNELS; i++)
+		{
+			channellist[i].opened = 0;
+			logical_channel_close(channellist + i);
+			if (i > 1)
+				close(pty[i]);
+		}
+		mux_watch_remove(serial.g_source);
+		serial.g_source = -1;
+		serial_thread_stop();
+		if (serial.g_source_out != (guint)-1)
+			mux_watch_remove(serial.g_source_out);
+		serial.g_source_out = -1;
+		g_io_channel_unref(serial.g_channel);
+		serial.g_channel = NULL;
+		close(serial.fd);
+		serial.fd = -1;
+		serial.tx_blocked = 0;
+		waitpid(pid, NULL, 0);
+		session_close(&serial);
+		serial.state = MUX_STATE_OFF;
+	}
+	return 0;
+}
+
+/**
+ * measures the throughput of the frame codec on AT command like text
+ * and on random binary data (as seen on ppp channels)
+ */
+static int benchmark(
+	char *_name)
+{
+	static unsigned char data[64 * 1024];
+	static unsigned char adv_buf[2 * sizeof(data)];
+	static const char *text = "AT+CGDCONT=1,\"IP\",\"internet\"\r\n";
+	static const char *patterns[] = { "text", "binary", };
+	const int rounds = 512;
+	unsigned char head[2] = { GSM0710_EA | GSM0710_CR | (1 << 2), GSM0710_TYPE_UIH };
+	unsigned char fcs = frame_calc_crc(head, 2);
+	static unsigned char wire[max(GSM0710_BUFFER_SIZE / 2, GSM0710_ADV_FRAME_SIZE(GSM0710_MAX_N1))];
+	int wire_length, wire_size;
+	static GSM0710_Buffer buffer;
+	GSM0710_Buffer *buf = &buffer;
+	GSM0710_Frame frame;
+	struct timespec start, stop;
+	int p, i;
+	cmux_configure();
+	wire_size = max(GSM0710_BUFFER_SIZE / 2, GSM0710_ADV_FRAME_SIZE(cmux_N1));
+	if (wire_size > sizeof(wire))
+	{
+		fprintf(stderr, "%s: frame size %d above %d\n", _name, cmux_N1, GSM0710_MAX_N1);
+		return -1;
+	}
+	if (gsm0710_buffer_init(buf, max(buffer_size, wire_size)) < 0)
+		return -1;
+	fprintf(stdout, "%s codec benchmark, %d x %d bytes\n", _name, rounds, (int)sizeof(data));
+	for (p = 0; p < sizeof(patterns) / sizeof(*patterns); p++)
+	{
+		srand(1);
+		for (i = 0; i < sizeof(data); i++)
+			data[i] = p ? rand() : text[i % strlen(text)];
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < rounds; i++)
+			fill_adv_frame_buf(adv_buf, data, sizeof(data));
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		fprintf(stdout, "\tadvanced mode escaping, %s: %.1f MB/s\n", patterns[p],
+			benchmark_rate(&start, &stop, (double)rounds * sizeof(data)));
+//a bunch of N1 sized frames as they come from the modem
+		wire_length = 0;
+		while (wire_length + GSM0710_ADV_FRAME_SIZE(cmux_N1) <= wire_size)
+		{
+			wire[wire_length++] = GSM0710_FRAME_ADV_FLAG;
+			wire_length += fill_adv_frame_buf(wire + wire_length, head, 2);
+			wire_length += fill_adv_frame_buf(wire + wire_length, data, cmux_N1);
+			wire_length += fill_adv_frame_buf(wire + wire_length, &fcs, 1);
+			wire[wire_length++] = GSM0710_FRAME_ADV_FLAG;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (i = 0; i < rounds * sizeof(data) / wire_length; i++)
+		{
+			gsm0710_buffer_write(buf, wire, wire_length);
+			while (gsm0710_advanced_buffer_get_frame(buf, &frame))
+				;
+			gsm0710_buffer_release(buf);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &stop);
+		fprintf(stdout, "\tadvanced mode decoding, %s: %.1f MB/s\n", patterns[p],
+			benchmark_rate(&start, &stop, (double)i * wire_length));
+	}
+	gsm0710_buffer_destroy(buf);
+	return benchmark_relay(_name);
+}
 
 /**
  * The main program
@@ -1919,19 +5800,49 @@ int main(
 	pid_t parent_pid;
 //for fault tolerance
 	serial.devicename = "/dev/ttySAC0";
-	while ((opt = getopt(argc, argv, "dvs:t:p:f:Vh?m:b:P:x:")) > 0)
+	serial.g_source_out = -1;
+	serial.g_source_watchdog = -1;
+	serial.g_source_boot = -1;
+	serial.g_source_probe = -1;
+	serial.g_source_rpn = -1;
+	while ((opt = getopt(argc, argv, "deTaRC:vs:t:p:f:r:VBh?m:b:P:x:w:D:S:Ek:")) > 0)
 	{
 		switch (opt)
 		{
 		case 'v':
 			syslog_level++;
 			break;
+		case 'e':
+			use_epoll = 1;
+			break;
+		case 'T':
+			use_thread = 1;
+			break;
+		case 'a':
+			at_pipeline = 1;
+			break;
+		case 'R':
+			use_resume = 1;
+			break;
+		case 'C':
+			cache_file = optarg;
+			break;
 		case 'd':
 			no_daemon = !no_daemon;
 			break;
 		case 'x':
 			serial.pm_base_dir = optarg;
 			break;
+		case 'w':
+			wakeup_idle = atoi(optarg);
+			break;
+		case 'D':
+			if (modem_profile_select(optarg) < 0)
+			{
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
 		case 's':
 			serial.devicename = optarg;
 			break;
@@ -1946,23 +5857,63 @@ int main(
 			break;
 		// will be removed if +CMUX? works
 		case 'f':
-			cmux_N1 = atoi(optarg);
+			cmux_N1_limit = atoi(optarg);
+			if (cmux_N1_limit < 1 || cmux_N1_limit > GSM0710_MAX_N1)
+			{
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'r':
+			buffer_size = atoi(optarg);
+			if (buffer_size <= 0 || buffer_size > GSM0710_MAX_BUFFER_SIZE)
+			{
+				usage(argv[0]);
+				exit(1);
+			}
 			break;
 		case 'm':
 			if (!strcmp(optarg, "basic"))
-				cmux_mode = 0;
+				cmux_mode_wanted = 0;
 			else if (!strcmp(optarg, "advanced"))
-				cmux_mode = 1;
+				cmux_mode_wanted = 1;
 			else
-				cmux_mode = 0;
+				cmux_mode_wanted = 0;
 			break;
 		case 'b':
-			cmux_port_speed = baud_rate_index(atoi(optarg));
+			if ((cmux_port_speed_wanted = baud_rate_index(atoi(optarg))) <= 0)
+			{
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'E':
+			cmux_subset_wanted = GSM0710_SUBSET_I;
+			break;
+		case 'k':
+			cmux_k = atoi(optarg);
+			if (cmux_k < 1 || cmux_k > GSM0710_MAX_K)
+			{
+				usage(argv[0]);
+				exit(1);
+			}
+			break;
+		case 'S':
+			rpn_speed = atoi(optarg);
+			if (rpn_rate_index(rpn_speed) < 0)
+			{
+				usage(argv[0]);
+				exit(1);
+			}
 			break;
 		case 'V':
 			show_version(argv[0]);
 			exit(0);
 			break;
+		case 'B':
+			benchmark(argv[0]);
+			exit(0);
+			break;
 		default:
 		case '?':
 		case 'h':
@@ -2009,27 +5960,16 @@ int main(
 	else
 		openlog(argv[0], LOG_NDELAY | LOG_PID, LOG_LOCAL0);
 	SYSCHECK(dbus_init());
-//allocate memory for data structures
-	if ((serial.in_buf = gsm0710_buffer_init()) == NULL
-	 || (serial.adv_frame_buf = (unsigned char*)malloc((cmux_N1 + 3) * 2 + 2)) == NULL)
-	{
-		LOG(LOG_ALERT, "Out of memory");
-		exit(-1);
-	}
+	SYSCHECK(mux_loop_init());
 	LOG(LOG_DEBUG, "%s %s starting", *argv, revision);
 //Initialize modem and virtual ports
 	serial.state = MUX_STATE_OPENING;
 	watchdog(&serial);
 //start waiting for input and forwarding it back and forth --
-	main_loop = g_main_loop_new(NULL, FALSE);
-	g_main_loop_run(main_loop); // will/may be terminated in signal_treatment
-	g_main_loop_unref(main_loop);
+	while (main_running) // will/may be terminated in signal_treatment
+		mux_iteration(TRUE);
 //finalize everything
 	SYSCHECK(close_devices());
-	free(serial.adv_frame_buf);
-	gsm0710_buffer_destroy(serial.in_buf);
-	LOG(LOG_INFO, "Received %ld frames and dropped %ld received frames during the mux-mode",
-		serial.in_buf->received_count, serial.in_buf->dropped_count);
 	SYSCHECK(dbus_deinit());
 	LOG(LOG_DEBUG, "%s finished", argv[0]);
 	closelog();// close syslog
@@ -86,14 +86,8 @@ gboolean muxer_control_get_power (MuxerControl* self, const char* origin, gboole
 }
 
 
-gboolean muxer_control_alloc_channel (MuxerControl* self, const char* origin, const char* channel, GError** error) {
-	g_return_val_if_fail (IS_MUXER_CONTROL (self), FALSE);
-	g_return_val_if_fail (origin != NULL, FALSE);
-	g_return_val_if_fail (channel != NULL, FALSE);
-	gboolean success = c_alloc_channel (origin, channel);
-	if (!success)
-		g_set_error( error, MUXER_ERROR, MUXER_ALLOC_ERROR, "All channels are used" );
-	return success;
+gboolean muxer_control_alloc_channel (MuxerControl* self, const char* origin, DBusGMethodInvocation* context) {
+	return c_alloc_channel (origin, context);
 }
 
 MuxerControl* muxer_control_gen (void) {
@@ -25,9 +25,11 @@ public class MuxerControl : GLib.Object
 	{
 		return gsm0710muxd.c_get_power(origin);
 	}
-	public bool alloc_channel(string origin, string channel)
+	// answered by c_alloc_channel() when the channel is open, static and
+	// nullable so that no check returns without answering the call
+	public static bool alloc_channel(MuxerControl? self, string? origin, gsm0710muxd.MethodInvocation? context)
 	{
-		return gsm0710muxd.c_alloc_channel(origin, channel);
+		return gsm0710muxd.c_alloc_channel(origin, context);
 	}
 	public static MuxerControl gen()
 	{